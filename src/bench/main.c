@@ -0,0 +1,296 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/alloc.H>
+#include <libfam/env.H>
+#include <libfam/error.H>
+#include <libfam/format.H>
+#include <libfam/misc.H>
+#include <libfam/spin.H>
+#include <libfam/sys.H>
+#include <libfam/syscall.H>
+#include <libfam/syscall_const.H>
+
+#define BENCH_SLOTS 1024
+#define BENCH_OPS_DEFAULT 200000
+#define BENCH_PROCS_DEFAULT 4
+#define BENCH_MAX_PROCS 64
+/* Log-linear latency buckets: 8 per power of two of ticks */
+#define HIST_SUB 3
+#define HIST_BUCKETS (64 << HIST_SUB)
+
+typedef struct {
+	const u8 *name;
+	u64 (*size)(u64 r);
+	u64 resize_pct;
+} Scenario;
+
+typedef struct {
+	u64 ops;
+	u64 failures;
+	u64 cas_retries;
+	i64 micros;
+	u64 ticks;
+	u64 hist[HIST_BUCKETS];
+} BenchResult;
+
+static u64 next_rand(u64 *state) {
+	u64 x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static u64 bucket_of(u64 v) {
+	u64 msb;
+	if (v < (1UL << HIST_SUB)) return v;
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - HIST_SUB + 1) << HIST_SUB) |
+	       ((v >> (msb - HIST_SUB)) & ((1UL << HIST_SUB) - 1));
+}
+
+static u64 bucket_floor(u64 b) {
+	u64 shift = b >> HIST_SUB, sub = b & ((1UL << HIST_SUB) - 1);
+	if (!shift) return sub;
+	return ((1UL << HIST_SUB) | sub) << (shift - 1);
+}
+
+/* Mostly small objects with a tail of buffers, as seen by connections */
+static u64 size_mixed(u64 r) {
+	u64 pick = r % 100;
+	r >>= 8;
+	if (pick < 60) return 8 + r % 120;
+	if (pick < 85) return 128 + r % 896;
+	if (pick < 95) return 1024 + r % (15 * 1024);
+	if (pick < 99) return 16384 + r % (240 * 1024);
+	return 1024 * 1024 + r % (3 * 1024 * 1024);
+}
+
+static u64 size_small(u64 r) { return 8 + (r >> 8) % 504; }
+
+static u64 size_buffers(u64 r) { return 4096 + (r >> 8) % (60 * 1024); }
+
+static const Scenario scenarios[] = {{"small", size_small, 0},
+				     {"mixed", size_mixed, 10},
+				     {"buffers", size_buffers, 40}};
+
+static u64 env_u64(const u8 *name, u64 def) {
+	u8 *v = getenv(name);
+	u128 ret;
+	if (!v || !*v) return def;
+	ret = string_to_uint128(v, strlen(v));
+	return ret ? (u64)ret : def;
+}
+
+static u64 cas_retries(Alloc *a) {
+	AllocStats stats;
+	if (alloc_stats_impl(a, &stats) < 0) return 0;
+	return stats.cas_retries;
+}
+
+static void bench_proc(Alloc *a, const Scenario *sc, u64 ops, u64 seed,
+		       BenchResult *res) {
+	void *slots[BENCH_SLOTS] = {0};
+	u64 state = seed * 0x9E3779B97F4A7C15UL + 1, i, start, t;
+	u64 retries = cas_retries(a);
+	i64 begin = micros();
+
+	start = cpu_ticks();
+	for (i = 0; i < ops; i++) {
+		u64 r = next_rand(&state), slot = r % BENCH_SLOTS;
+		u64 size = sc->size(next_rand(&state));
+		void **p = &slots[slot];
+
+		t = cpu_ticks();
+		if (!*p) {
+			if ((*p = alloc_impl(a, size))) *(u8 *)*p = 1;
+		} else if ((r >> 32) % 100 < sc->resize_pct) {
+			void *n = resize_impl(a, *p, size);
+			if (n) *p = n;
+		} else {
+			release_impl(a, *p);
+			*p = NULL;
+			t = cpu_ticks() - t;
+			res->hist[bucket_of(t)]++;
+			continue;
+		}
+		t = cpu_ticks() - t;
+		if (!*p) res->failures++;
+		res->hist[bucket_of(t)]++;
+	}
+	res->ticks = cpu_ticks() - start;
+	res->micros = micros() - begin;
+	res->ops = ops;
+	res->cas_retries = cas_retries(a) - retries;
+
+	for (i = 0; i < BENCH_SLOTS; i++) release_impl(a, slots[i]);
+}
+
+static u64 percentile(const u64 *hist, u64 total, u64 per_mille) {
+	u64 i, seen = 0, want = (total * per_mille + 999) / 1000;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if ((seen += hist[i]) >= want) return bucket_floor(i);
+	return bucket_floor(HIST_BUCKETS - 1);
+}
+
+/* v is the lower edge of a histogram bucket, so a fraction of a
+ * nanosecond would claim precision the histogram does not have */
+static void print_ns(const u8 *label, u64 v, double ns_per_tick) {
+	print(" {}={}ns", label, (u64)((double)v * ns_per_tick + 0.5));
+}
+
+static i32 run(Alloc *a, const Scenario *sc, u64 procs, u64 ops) {
+	BenchResult *results = smap(sizeof(BenchResult) * procs), total;
+	double ops_per_sec, ns_per_tick;
+	u64 i, j, retries = 0;
+	i64 elapsed = 0;
+	u8 buf[64];
+	i32 pids[BENCH_MAX_PROCS];
+
+	if (!results) return -1;
+	for (i = 0; i < procs; i++) {
+		if ((pids[i] = two()) < 0) return -1;
+		if (!pids[i]) {
+			bench_proc(a, sc, ops, i + 1, &results[i]);
+			exit(0);
+		}
+	}
+	for (i = 0; i < procs; i++) waitid(P_PID, pids[i], NULL, WEXITED);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < procs; i++) {
+		total.ops += results[i].ops;
+		total.failures += results[i].failures;
+		total.ticks += results[i].ticks;
+		if (results[i].micros > elapsed) elapsed = results[i].micros;
+		retries += results[i].cas_retries;
+		total.micros += results[i].micros;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			total.hist[j] += results[i].hist[j];
+	}
+	munmap(results, sizeof(BenchResult) * procs);
+
+	ops_per_sec = elapsed ? (double)total.ops * 1e6 / (double)elapsed : 0;
+	ns_per_tick = total.ticks
+			  ? (double)total.micros * 1000.0 / (double)total.ticks
+			  : 0;
+	buf[double_to_string(buf, ops_per_sec, 0)] = 0;
+	print("{} procs={} ops/sec={}", sc->name, procs, buf);
+	print_ns("p50", percentile(total.hist, total.ops, 500), ns_per_tick);
+	print_ns("p99", percentile(total.hist, total.ops, 990), ns_per_tick);
+	print_ns("p999", percentile(total.hist, total.ops, 999), ns_per_tick);
+	println(" cas_retries={} failures={}", retries, total.failures);
+	return 0;
+}
+
+extern void (*__init_array_start[])(void);
+extern void (*__init_array_end[])(void);
+
+static void call_constructors(void) {
+	void (**func)(void);
+	for (func = __init_array_start; func < __init_array_end; func++) {
+		(*func)();
+	}
+}
+
+i32 main(i32 argc, u8 *argv[], u8 *envp[]);
+
+#ifdef __aarch64__
+__asm__(
+    ".section .text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    ldr x0, [sp]\n"
+    "    add x1, sp, #8\n"
+    "    add x3, x0, #1\n"
+    "    lsl x3, x3, #3\n"
+    "    add x2, x1, x3\n"
+    "    sub sp, sp, x3\n"
+    "    bl main\n"
+    "    mov x8, #93\n"
+    "    svc #0\n");
+#endif /* __aarch64__ */
+
+#ifdef __amd64__
+__asm__(
+    ".section .text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    movq (%rsp), %rdi\n"
+    "    lea 8(%rsp), %rsi\n"
+    "    mov %rdi, %rcx\n"
+    "    add $1, %rcx\n"
+    "    shl $3, %rcx\n"
+    "    lea (%rsi, %rcx), %rdx\n"
+    "    mov %rsp, %rcx\n"
+    "    and $-16, %rsp\n"
+    "    call main\n"
+    "    mov %rax, %rdi\n"
+    "    mov $60, %rax\n"
+    "    syscall\n");
+#endif /* __amd64__ */
+
+/* Environment: BENCH_PROCS (max children), BENCH_OPS (per child) and
+ * BENCH_SCENARIO (small, mixed or buffers; all by default). */
+i32 main(i32 argc __attribute__((unused)), u8 **argv __attribute__((unused)),
+	 u8 **envp) {
+	u64 procs, ops, n, i;
+	u8 *only;
+	Alloc *a;
+
+	call_constructors();
+	environ = envp;
+	init_environ();
+
+	procs = env_u64("BENCH_PROCS", BENCH_PROCS_DEFAULT);
+	if (!procs) procs = 1;
+	if (procs > BENCH_MAX_PROCS) procs = BENCH_MAX_PROCS;
+	ops = env_u64("BENCH_OPS", BENCH_OPS_DEFAULT);
+	only = getenv("BENCH_SCENARIO");
+
+	a = alloc_init_growable(ALLOC_TYPE_SMAP, CHUNK_SIZE * 64,
+				CHUNK_SIZE * 1024);
+	if (!a) {
+		println("bench: could not create arena: err={}", err);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (only && *only && strcmp(only, scenarios[i].name)) continue;
+		/* 1, 2, 4, ... and finally procs itself */
+		for (n = 1;; n = n * 2 > procs ? procs : n * 2) {
+			if (run(a, &scenarios[i], n, ops) < 0) {
+				println("bench: {} failed: err={}",
+					scenarios[i].name, err);
+				alloc_destroy(a);
+				return -1;
+			}
+			if (n >= procs) break;
+		}
+	}
+	alloc_destroy(a);
+	return 0;
+}
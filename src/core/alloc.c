@@ -29,119 +29,26 @@
 #include <libfam/error.H>
 #include <libfam/format.H>
 #include <libfam/misc.H>
+#include <libfam/syscall_const.H>
 
 u64 _debug_cas_loop = 0;
 u64 _debug_alloc_failure = 0;
 u64 _debug_alloc_failure_bypass_count = 0;
 
 #define SHM_SIZE_DEFAULT (CHUNK_SIZE * 64)
+#define SHM_MAX_DEFAULT (CHUNK_SIZE * 4096)
 #define CHUNK_HEADER_OFFSET 16
 #define MAX_SLAB_SIZES 32
+#define SLAB_RETIRED (1U << 31)
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH (MAGAZINE_SIZE >> 1)
+#define MAGAZINE_MAX_SLAB_SIZE 4096
+#define MAGAZINE_CLASSES 10 /* slab sizes 8 through MAGAZINE_MAX_SLAB_SIZE */
+#define HUGE_PAGE_SIZE ((u64)(0x1 << 21))
 
-/* Consolidated bitmap allocation macro */
-#define FIND_FREE_BITS(base, max, result, last_free_ptr, bits)                               \
-	do {                                                                                 \
-		u64 max_words = ((max) + 63) >> 6;                                           \
-		u64 *bitmap = (u64 *)((u8 *)(base));                                         \
-		u64 local_last_free = ALOAD(last_free_ptr);                                  \
-		u64 start_word = local_last_free;                                            \
-		i32 wrapped = 0;                                                             \
-		(result) = (u64) - 1;                                                        \
-		while (1) {                                                                  \
-			u64 word_idx = local_last_free;                                      \
-			if (word_idx >= max_words) {                                         \
-				if (wrapped) break;                                          \
-				word_idx = 0;                                                \
-				wrapped = 1;                                                 \
-			}                                                                    \
-			u64 word = bitmap[word_idx];                                         \
-			if (word != U64_MAX) {                                               \
-				u64 temp_word = ~word;                                       \
-				u64 bit_start =                                              \
-				    (bits) == 1 ? ctz64(temp_word) : 0;                      \
-				i32 found = 0;                                               \
-				for (; bit_start <= (u64)64 - (bits);                        \
-				     bit_start++) {                                          \
-					u64 mask = ((1UL << (bits)) - 1)                     \
-						   << bit_start;                             \
-					if ((bits) == 1 ||                                   \
-					    (temp_word & mask) == mask) {                    \
-						if (word_idx * 64 +                          \
-							bit_start + (bits) <=                \
-						    (max)) {                                 \
-							if (__cas64(                         \
-								&bitmap                      \
-								    [word_idx],              \
-								&word,                       \
-								word |                       \
-								    mask)) {                 \
-								(result) =                   \
-								    word_idx *               \
-									64 +                 \
-								    bit_start;               \
-								found = 1;                   \
-								break;                       \
-							} else {                             \
-								word = bitmap                \
-								    [word_idx];              \
-								temp_word =                  \
-								    ~word;                   \
-								if (word ==                  \
-								    U64_MAX)                 \
-									break;               \
-								if ((bits) ==                \
-								    1)                       \
-									bit_start =          \
-									    ctz64(           \
-										temp_word) - \
-									    1;               \
-								else if (                    \
-								    bit_start >              \
-								    0)                       \
-									bit_start--;         \
-								else                         \
-									break;               \
-							}                                    \
-						}                                            \
-					}                                                    \
-					if ((bits) == 1) break;                              \
-				}                                                            \
-				if (found) break;                                            \
-			}                                                                    \
-			local_last_free = word_idx + 1;                                      \
-			if (wrapped && local_last_free > start_word) break;                  \
-		}                                                                            \
-		if ((result) == (u64) - 1 &&                                                 \
-		    local_last_free > ALOAD(last_free_ptr)) {                                \
-			u64 expected = ALOAD(last_free_ptr);                                 \
-			while (expected < local_last_free &&                                 \
-			       !__cas64(last_free_ptr, &expected,                            \
-					local_last_free))                                    \
-				expected = ALOAD(last_free_ptr);                             \
-		}                                                                            \
-	} while (0)
-
-/* Consolidated bitmap release macro */
-#define RELEASE_BITS(base, index, last_free_ptr, bits)                       \
-	do {                                                                 \
-		u64 new_last_free = (index) / 64;                            \
-		u64 expected = ALOAD(last_free_ptr);                         \
-		u64 *bitmap = (u64 *)((u8 *)(base));                         \
-		u64 *word_ptr = &bitmap[(index) / 64];                       \
-		u64 bit_mask = ((1UL << (bits)) - 1) << ((index) % 64);      \
-		while (1) {                                                  \
-			u64 old_value = *word_ptr, new_value;                \
-			if ((old_value & bit_mask) != bit_mask) {            \
-				panic("Double free or invalid bits!");       \
-			}                                                    \
-			new_value = old_value & ~bit_mask;                   \
-			if (__cas64(word_ptr, &old_value, new_value)) break; \
-		}                                                            \
-		while (expected > new_last_free &&                           \
-		       !__cas64(last_free_ptr, &expected, new_last_free))    \
-			expected = ALOAD(last_free_ptr);                     \
-	} while (0)
-
+#define CHUNKS_NEEDED(size) \
+	(1 + (((size) + (CHUNK_HEADER_OFFSET - 1)) / CHUNK_SIZE))
+#define CHUNK_BITMAP(a) ((u64 *)((u64)(a) + sizeof(Alloc)))
 #define CHUNK_OFFSET(a) \
 	((u8 *)((u64)a + sizeof(Alloc) + a->bitmap_pages * PAGE_SIZE))
 #define BITMAP_CAPACITY(slab_size) \
@@ -183,19 +90,26 @@ u64 _debug_alloc_failure_bypass_count = 0;
 
 struct Alloc {
 	u64 bitmap_pages;
-	u64 bitmap_bits;
+	u64 bitmap_bits; /* committed chunks, only ever grows */
 	u64 bitmap_bytes;
-	u64 size;
+	u64 size;	 /* reserved bytes */
+	u64 max_bits;
 	u64 slab_pointers[MAX_SLAB_SIZES];
+	u64 slab_walkers[MAX_SLAB_SIZES];   /* processes on each chain */
+	u64 slab_retired[MAX_SLAB_SIZES];   /* unlinked, waiting for walkers */
+	u32 slab_reclaimers[MAX_SLAB_SIZES]; /* pid unlinking from a chain */
 	u64 last_free;
 	u64 allocated_bytes;
+	AllocType type;
+	u32 flags; /* ALLOC_FLAG_* that took effect */
 };
 
 typedef struct {
 	u32 slab_size;
+	u32 used; /* slots handed out, or SLAB_RETIRED once unlinked */
 	u64 last_free;
 	u64 next;
-	u8 padding[4];
+	u64 prev; /* only read by the reclaimer, -1 for the head */
 } Chunk;
 
 struct chunk_header {
@@ -203,17 +117,232 @@ struct chunk_header {
 	u64 chunk_count;
 };
 
+/* Chunk run whose data starts past the header at an alignment the chunk
+ * base lacks. Read as a Chunk its slab_size is 0, which no slab has, and
+ * offset tells the returned pointer from a stray one. */
+struct aligned_header {
+	u32 slab_size;
+	u32 offset;
+	u64 chunk_count;
+	u64 size;
+};
+
+/* Per-process cache of free slab slots. Slots held here are still marked
+ * allocated in the shared bitmaps, so the hot path touches no shared state. */
+typedef struct {
+	u64 count;
+	void *slots[MAGAZINE_SIZE];
+} Magazine;
+
+/* Allocations above MAX_MULTI_CHUNK_SIZE are mapped directly. The table is
+ * process-local and grows as needed; children created after the mapping
+ * inherit both. */
+typedef struct {
+	Alloc *a;
+	void *ptr;
+	u64 mapped;
+	bool hugetlb;
+} LargeObject;
+
 STATIC Alloc *_alloc_ptr__ = NULL;
+STATIC Magazine _magazines__[MAGAZINE_CLASSES];
+STATIC LargeObject *_large_objects__ = NULL;
+STATIC u64 _large_object_count__ = 0;
+STATIC u64 _large_object_capacity__ = 0;
+/* Per-process, so plain increments are enough */
+STATIC u64 _alloc_failures__ = 0;
+STATIC u64 _alloc_class_failures__[MAX_SLAB_SIZES];
+STATIC u64 _alloc_reclaimed__ = 0;
+STATIC u64 _alloc_cas_retries__ = 0;
+
+static __inline__ u64 ctz64(u64 x) {
+	return x ? (u64)__builtin_ctzll(x) : 64;
+}
+
+static __inline__ u64 clz64(u64 x) {
+	return x ? (u64)__builtin_clzll(x) : 64;
+}
+
+static __inline__ u64 popcount64(u64 x) {
+	return (u64)__builtin_popcountll(x);
+}
 
-/* Software CTZ for C89, avoids __builtin_ctzll */
-static unsigned long long ctz64(unsigned long long x) {
-	unsigned long long count = 0;
-	if (!x) return 64;
-	while (!(x & 1)) {
-		count++;
-		x >>= 1;
+/* Mask of the bits of word_idx that lie below max */
+static __inline__ u64 valid_bits(u64 word_idx, u64 max) {
+	u64 rem = max - word_idx * 64;
+	return rem >= 64 ? U64_MAX : (1UL << rem) - 1;
+}
+
+/* Bit i of the result is set iff bits i..i+n-1 of x are all set (n <= 64) */
+static __inline__ u64 run_mask(u64 x, u64 n) {
+	u64 k = 1;
+	while (k < n && x) {
+		u64 shift = k < n - k ? k : n - k;
+		x &= x >> shift;
+		k += shift;
 	}
-	return count;
+	return x;
+}
+
+/* Mask covering bits [index, index + n) of a single word */
+static __inline__ u64 word_mask(u64 index, u64 n) {
+	return n == 64 ? U64_MAX : ((1UL << n) - 1) << (index & 63);
+}
+
+/* A CAS on shared allocator state that counts the attempts it loses */
+static __inline__ bool alloc_cas(u64 *ptr, u64 *expected, u64 desired) {
+	if (__cas64(ptr, expected, desired)) return true;
+	_alloc_cas_retries__++;
+	return false;
+}
+
+STATIC void clear_bits(u64 *bitmap, u64 index, u64 bits) {
+	u64 end = index + bits;
+	while (index < end) {
+		u64 n = 64 - (index & 63), mask, old_value;
+		u64 *word_ptr = &bitmap[index >> 6];
+		if (n > end - index) n = end - index;
+		mask = word_mask(index, n);
+		old_value = ALOAD(word_ptr);
+		do {
+			if ((old_value & mask) != mask) {
+				panic("Double free or invalid bits!");
+			}
+		} while (!alloc_cas(word_ptr, &old_value, old_value & ~mask));
+		index += n;
+	}
+}
+
+/* Claims [index, index + bits) word by word, undoing on a lost race */
+STATIC bool set_bits(u64 *bitmap, u64 index, u64 bits) {
+	u64 start = index, end = index + bits;
+	while (index < end) {
+		u64 n = 64 - (index & 63), mask, old_value;
+		u64 *word_ptr = &bitmap[index >> 6];
+		if (n > end - index) n = end - index;
+		mask = word_mask(index, n);
+		old_value = ALOAD(word_ptr);
+		do {
+			if (old_value & mask) {
+				if (index > start)
+					clear_bits(bitmap, start, index - start);
+				return false;
+			}
+		} while (!alloc_cas(word_ptr, &old_value, old_value | mask));
+		index += n;
+	}
+	return true;
+}
+
+/* Finds the lowest run of `bits` clear bits starting in words [from, to) */
+STATIC u64 find_run(u64 *bitmap, u64 max, u64 from, u64 to, u64 bits) {
+	u64 run_start = 0, run_len = 0, word_idx = from;
+
+	while (word_idx < to) {
+		u64 free, in_word, high;
+
+		/* Skip four full words per iteration */
+		if (word_idx + 4 <= to &&
+		    (ALOAD(&bitmap[word_idx]) & ALOAD(&bitmap[word_idx + 1]) &
+		     ALOAD(&bitmap[word_idx + 2]) &
+		     ALOAD(&bitmap[word_idx + 3])) == U64_MAX) {
+			run_len = 0;
+			word_idx += 4;
+			continue;
+		}
+
+		free = ~ALOAD(&bitmap[word_idx]) & valid_bits(word_idx, max);
+		if (!free) {
+			run_len = 0;
+			word_idx++;
+			continue;
+		}
+
+		if (run_len) {
+			/* Clear low bits extend the run from earlier words */
+			u64 low = ctz64(~free);
+			if (run_len + low >= bits) return run_start;
+			if (low == 64) {
+				run_len += 64;
+				word_idx++;
+				continue;
+			}
+			run_len = 0;
+		}
+
+		if (bits <= 64 && (in_word = run_mask(free, bits)))
+			return word_idx * 64 + ctz64(in_word);
+
+		/* Clear high bits may start a run into the next word */
+		high = clz64(~free);
+		run_start = word_idx * 64 + 64 - high;
+		run_len = high;
+		word_idx++;
+	}
+	return (u64)-1;
+}
+
+STATIC u64 find_free_bits(u64 *bitmap, u64 max, u64 *last_free, u64 bits) {
+	u64 max_words = (max + 63) >> 6, hint, res;
+
+	do {
+		hint = ALOAD(last_free);
+		if (hint >= max_words) hint = 0;
+		res = find_run(bitmap, max, hint, max_words, bits);
+		if (res == (u64)-1 && hint)
+			res = find_run(bitmap, max, 0, max_words, bits);
+		if (res == (u64)-1) return res;
+		if (set_bits(bitmap, res, bits)) break;
+		_alloc_cas_retries__++; /* Lost the run to another claimer */
+	} while (true);
+
+	/* Single bit searches saw every word before res full */
+	if (bits == 1 && (res >> 6) > hint) __cas64(last_free, &hint, res >> 6);
+	return res;
+}
+
+STATIC void release_bits(u64 *bitmap, u64 index, u64 *last_free, u64 bits) {
+	u64 expected = ALOAD(last_free);
+	clear_bits(bitmap, index, bits);
+	while (expected > (index >> 6) &&
+	       !__cas64(last_free, &expected, index >> 6))
+		expected = ALOAD(last_free);
+}
+
+/* Faults in [offset, end) of a hugetlb arena mapped with MAP_NORESERVE, so
+ * running out of huge pages fails here rather than with SIGBUS on first
+ * touch. Widened to whole huge pages, which the mapping is made of. */
+STATIC i32 arena_populate(void *base, u64 offset, u64 end) {
+	u64 start = offset & ~(HUGE_PAGE_SIZE - 1);
+	end = (end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	return madvise((u8 *)base + start, end - start, MADV_POPULATE_WRITE);
+}
+
+/* Commit more of the reserved range after a failed search that saw
+ * `seen` chunks. Returns false once the reservation is exhausted. */
+STATIC bool grow_arena(Alloc *a, u64 seen, u64 needed) {
+	u64 next, base = (u64)(CHUNK_OFFSET(a) - (u8 *)a);
+	i32 save = err;
+	if (seen != ALOAD(&a->bitmap_bits)) return true; /* Already grown */
+	if (seen >= a->max_bits) return false;
+	next = seen << 1;
+	if (next < seen + needed) next = seen + needed;
+	if (next > a->max_bits) next = a->max_bits;
+	if (a->flags & ALLOC_FLAG_HUGETLB) {
+		/* Settle for what was asked when the pool cannot double */
+		if (arena_populate(a, base + seen * CHUNK_SIZE,
+				   base + next * CHUNK_SIZE) < 0) {
+			if (next <= seen + needed ||
+			    arena_populate(a, base + seen * CHUNK_SIZE,
+					   base + (seen + needed) * CHUNK_SIZE) < 0)
+				return false;
+			next = seen + needed;
+		}
+		err = save;
+	}
+	/* Losing the race means another process grew it */
+	__cas64(&a->bitmap_bits, &seen, next);
+	return true;
 }
 
 STATIC u64 get_memory_bytes(void) {
@@ -234,9 +363,63 @@ STATIC u64 get_memory_bytes(void) {
 	return shm_size;
 }
 
+STATIC u64 get_memory_max_bytes(u64 size) {
+	u64 max_size = SHM_MAX_DEFAULT;
+	u8 *smembytes = getenv("SHARED_MEMORY_MAX_BYTES");
+	if (smembytes) {
+		u64 bytes = string_to_uint128(smembytes, strlen(smembytes));
+		if (bytes % CHUNK_SIZE != 0) {
+			const u8 *msg =
+			    "WARN: SHARED_MEMORY_MAX_BYTES must be divisible by "
+			    "CHUNK_SIZE. Using default.\n";
+			write(2, msg, strlen(msg));
+		} else {
+			max_size = bytes;
+		}
+	}
+	return max_size < size ? size : max_size;
+}
+
+STATIC u32 get_memory_flags(void) {
+	u32 flags = 0;
+	u8 *hugepages = getenv("SHARED_MEMORY_HUGEPAGES");
+	u8 *populate = getenv("SHARED_MEMORY_POPULATE");
+	u8 *numa = getenv("SHARED_MEMORY_NUMA");
+
+	if (hugepages && !strcmp(hugepages, "hugetlb"))
+		flags |= ALLOC_FLAG_HUGETLB;
+	else if (hugepages && !strcmp(hugepages, "thp"))
+		flags |= ALLOC_FLAG_THP;
+	else if (hugepages) {
+		const u8 *msg =
+		    "WARN: SHARED_MEMORY_HUGEPAGES must be 'hugetlb' or "
+		    "'thp'. Ignoring.\n";
+		write(2, msg, strlen(msg));
+	}
+	if (populate && !strcmp(populate, "1")) flags |= ALLOC_FLAG_POPULATE;
+	if (numa && !strcmp(numa, "interleave"))
+		flags |= ALLOC_FLAG_NUMA_INTERLEAVE;
+	else if (numa && !strcmp(numa, "local"))
+		flags |= ALLOC_FLAG_NUMA_LOCAL;
+	else if (numa) {
+		const u8 *msg =
+		    "WARN: SHARED_MEMORY_NUMA must be 'interleave' or "
+		    "'local'. Ignoring.\n";
+		write(2, msg, strlen(msg));
+	}
+	return flags;
+}
+
 STATIC __attribute__((constructor)) void __init_alloc(void) {
 	u64 size = get_memory_bytes();
-	_alloc_ptr__ = alloc_init(ALLOC_TYPE_SMAP, size);
+	u32 flags = get_memory_flags();
+	_alloc_ptr__ =
+	    alloc_init_growable(ALLOC_TYPE_SMAP | ALLOC_INIT_FLAGS, size,
+				get_memory_max_bytes(size), flags);
+	/* Fall back to a fixed arena if the reservation is refused */
+	if (!_alloc_ptr__)
+		_alloc_ptr__ =
+		    alloc_init(ALLOC_TYPE_SMAP | ALLOC_INIT_FLAGS, size, flags);
 }
 
 STATIC u64 calculate_slab_size_impl(u64 value) {
@@ -250,14 +433,17 @@ STATIC u64 calculate_slab_index_impl(u64 value) {
 }
 
 STATIC u64 allocate_chunk_impl(Alloc *a) {
-	u64 res;
-	FIND_FREE_BITS((void *)((u64)a + sizeof(Alloc)), a->bitmap_bits, res,
-		       &a->last_free, 1);
+	u64 bits, res;
+	do {
+		bits = ALOAD(&a->bitmap_bits);
+		res = find_free_bits(CHUNK_BITMAP(a), bits, &a->last_free, 1);
+	} while (res == (u64)-1 && grow_arena(a, bits, 1));
 	if (res == (u64)-1) err = ENOMEM;
 	return res;
 }
 
-STATIC u64 atomic_load_or_allocate_impl(Alloc *a, u64 *ptr, u32 slab_size) {
+STATIC u64 atomic_load_or_allocate_impl(Alloc *a, u64 *ptr, u32 slab_size,
+					u64 prev) {
 	u64 cur, new_value, expected = (u64)-1;
 	Chunk *chunk;
 
@@ -269,6 +455,7 @@ STATIC u64 atomic_load_or_allocate_impl(Alloc *a, u64 *ptr, u32 slab_size) {
 		chunk = (void *)(new_value * CHUNK_SIZE + CHUNK_OFFSET(a));
 		memset(chunk, 0, sizeof(Chunk) + BITMAP_SIZE(slab_size));
 		chunk->next = (u64)-1;
+		chunk->prev = prev;
 		chunk->slab_size = slab_size;
 		chunk->last_free = 0;
 		if (__cas64(ptr, &expected, new_value)) {
@@ -280,104 +467,561 @@ STATIC u64 atomic_load_or_allocate_impl(Alloc *a, u64 *ptr, u32 slab_size) {
 			break;
 #endif
 		}
-		RELEASE_BITS((void *)((u64)a + sizeof(Alloc)), new_value,
-			     &a->last_free, 1);
+		release_bits(CHUNK_BITMAP(a), new_value, &a->last_free, 1);
 		expected = (u64)-1;
 	} while (1);
 
 	return cur;
 }
 
+#define SLAB_CHUNK(a, index) \
+	((Chunk *)(CHUNK_OFFSET(a) + (index) * CHUNK_SIZE))
+
+STATIC u64 reclaim_slab_class(Alloc *a, u64 index, u64 cur);
+
+/* Walkers only count themselves in and out and never wait, so a process
+ * that dies on a chain cannot block the others. Its count does keep the
+ * retired chunk of that class from being handed back, which stops further
+ * reclamation of the class but leaves every linked chunk usable. */
+STATIC void slab_chain_enter(Alloc *a, u64 index) {
+	__add64(&a->slab_walkers[index], 1);
+}
+
+STATIC void slab_chain_exit(Alloc *a, u64 index) {
+	if (__sub64(&a->slab_walkers[index], 1) == 1 &&
+	    ALOAD(&a->slab_retired[index]) != (u64)-1)
+		reclaim_slab_class(a, index, (u64)-1);
+}
+
+/* Unlinking is serialized per class by a try-lock holding the reclaimer's
+ * pid. A busy class is skipped rather than waited on, and the lock of a
+ * reclaimer that no longer exists is taken over. Every step of an unlink
+ * leaves the chain walkable, so a reclaimer dying mid-way leaks at most the
+ * chunk it was retiring. */
+STATIC bool slab_reclaim_trylock(Alloc *a, u64 index) {
+	u32 *lock = &a->slab_reclaimers[index], expected = 0,
+	    pid = (u32)getpid();
+	i32 save = err;
+	bool dead;
+
+	if (__cas32(lock, &expected, pid)) return true;
+	dead = kill((i32)expected, 0) == -1 && err == ESRCH;
+	err = save;
+	return dead && __cas32(lock, &expected, pid);
+}
+
+/* Hands the retired chunk of a class back once no walker can be on it */
+STATIC bool slab_retired_drain(Alloc *a, u64 index) {
+	u64 cur = ALOAD(&a->slab_retired[index]);
+	if (cur == (u64)-1) return true;
+	AFENCE();
+	if (ALOAD(&a->slab_walkers[index])) return false;
+	ASTORE(&a->slab_retired[index], (u64)-1);
+	release_bits(CHUNK_BITMAP(a), cur, &a->last_free, 1);
+	_alloc_reclaimed__++;
+	return true;
+}
+
+/* Unlinks an empty chunk, leaving its next pointer for walkers still on
+ * it. The head stays so a class cycling a single object does not allocate
+ * and reclaim a chunk each time, and the tail stays because appenders race
+ * on its next pointer. */
+STATIC bool slab_chunk_retire(Alloc *a, u64 index, u64 cur) {
+	Chunk *chunk = SLAB_CHUNK(a, cur);
+	u64 prev = chunk->prev, next = ALOAD(&chunk->next);
+	u32 expected = 0;
+
+	if (prev == (u64)-1 || next == (u64)-1) return false;
+	/* Allocators claiming a slot after this see SLAB_RETIRED and undo */
+	if (!__cas32(&chunk->used, &expected, SLAB_RETIRED)) return false;
+	SLAB_CHUNK(a, next)->prev = prev;
+	ASTORE(&SLAB_CHUNK(a, prev)->next, next);
+	ASTORE(&a->slab_retired[index], cur);
+	return true;
+}
+
+/* Retires chunk cur of a class, or with cur == -1 only hands back the
+ * retired chunk. Only the chunk that emptied is examined. */
+STATIC u64 reclaim_slab_class(Alloc *a, u64 index, u64 cur) {
+	u64 reclaimed = _alloc_reclaimed__;
+
+	if (!slab_reclaim_trylock(a, index)) return 0;
+	if (slab_retired_drain(a, index) && cur != (u64)-1 &&
+	    slab_chunk_retire(a, index, cur))
+		slab_retired_drain(a, index);
+	ASTORE(&a->slab_reclaimers[index], 0);
+	return _alloc_reclaimed__ - reclaimed;
+}
+
+/* Releasers count as walkers so the chunk cannot be handed back between
+ * the release of their last slot and the reclaim that follows */
+STATIC void slab_chunk_released(Alloc *a, Chunk *chunk, u32 slots) {
+	u64 index = calculate_slab_index_impl(chunk->slab_size);
+
+	slab_chain_enter(a, index);
+	if (__sub32(&chunk->used, slots) == slots)
+		reclaim_slab_class(
+		    a, index, ((u64)chunk - (u64)CHUNK_OFFSET(a)) / CHUNK_SIZE);
+	slab_chain_exit(a, index);
+}
+
+/* Counts n slots taken from the bitmap as used. Fails, handing the slots
+ * back, when the chunk was retired after they were found free. */
+STATIC bool slab_chunk_claim(Chunk *chunk, void **slots, u64 n) {
+	u64 *bitmap = (u64 *)((u64)chunk + sizeof(Chunk));
+	u8 *data = (u8 *)bitmap + BITMAP_SIZE(chunk->slab_size);
+	u64 i;
+
+	if (!(__add32(&chunk->used, n) & SLAB_RETIRED)) return true;
+	__sub32(&chunk->used, n);
+	for (i = 0; i < n; i++)
+		release_bits(bitmap,
+			     ((u8 *)slots[i] - data) / chunk->slab_size,
+			     &chunk->last_free, 1);
+	return false;
+}
+
 STATIC void *allocate_slab_impl(Alloc *a, u64 size) {
 	i32 index = calculate_slab_index_impl(size);
 	u64 slab_size = calculate_slab_size_impl(size);
-	u64 max, ret,
-	    cur = atomic_load_or_allocate_impl(a, &a->slab_pointers[index],
-					       slab_size);
+	u64 max, ret, cur;
 	void *ret_ptr = NULL;
 
+	slab_chain_enter(a, index);
+	cur = atomic_load_or_allocate_impl(a, &a->slab_pointers[index],
+					   slab_size, (u64)-1);
 	while (cur != (u64)-1) {
 		max = BITMAP_CAPACITY(slab_size);
-		Chunk *chunk = (Chunk *)(CHUNK_OFFSET(a) + cur * CHUNK_SIZE);
-		void *chunk_bitmap = (void *)((u64)chunk + sizeof(Chunk));
-		FIND_FREE_BITS(chunk_bitmap, max, ret, &chunk->last_free, 1);
+		Chunk *chunk = SLAB_CHUNK(a, cur);
+		u64 *chunk_bitmap = (u64 *)((u64)chunk + sizeof(Chunk));
+		ret = ALOAD(&chunk->used) & SLAB_RETIRED
+			  ? (u64)-1
+			  : find_free_bits(chunk_bitmap, max, &chunk->last_free,
+					   1);
 		if (ret != (u64)-1) {
 			u64 bitmap_size = BITMAP_SIZE(slab_size);
 			ret_ptr = (u8 *)chunk + sizeof(Chunk) + bitmap_size +
 				  (ret * slab_size);
-			MEMSAN_ADD(slab_size);
-			break;
+			if (slab_chunk_claim(chunk, &ret_ptr, 1)) {
+				MEMSAN_ADD(slab_size);
+				break;
+			}
+			ret_ptr = NULL;
 		}
-		cur = atomic_load_or_allocate_impl(a, &chunk->next, slab_size);
+		cur = atomic_load_or_allocate_impl(a, &chunk->next, slab_size,
+						   cur);
 	}
+	slab_chain_exit(a, index);
 
 	if (!ret_ptr) err = ENOMEM;
 
 	return ret_ptr;
 }
 
-STATIC void *allocate_chunk_multi(Alloc *a, u64 size) {
-	u64 chunks_needed =
-	    1 + ((size + (CHUNK_HEADER_OFFSET - 1)) / CHUNK_SIZE);
-	u64 res;
-	FIND_FREE_BITS((void *)((u64)a + sizeof(Alloc)), a->bitmap_bits, res,
-		       &a->last_free, chunks_needed);
+STATIC u64 allocate_slab_batch_impl(Alloc *a, u64 slab_size, void **out,
+				    u64 n) {
+	i32 index = calculate_slab_index_impl(slab_size);
+	u64 count = 0, cur;
+
+	slab_chain_enter(a, index);
+	cur = atomic_load_or_allocate_impl(a, &a->slab_pointers[index],
+					   slab_size, (u64)-1);
+	while (cur != (u64)-1) {
+		u64 max = BITMAP_CAPACITY(slab_size);
+		u64 max_words = (max + 63) >> 6, word_idx;
+		Chunk *chunk = SLAB_CHUNK(a, cur);
+		u64 *bitmap = (u64 *)((u64)chunk + sizeof(Chunk));
+		u8 *data = (u8 *)bitmap + BITMAP_SIZE(slab_size);
+		u64 first = ALOAD(&chunk->last_free), full_to = first;
+		u64 claimed = count;
+
+		if (ALOAD(&chunk->used) & SLAB_RETIRED) first = max_words;
+		for (word_idx = first; word_idx < max_words && count < n;
+		     word_idx++) {
+			u64 valid = (word_idx == max_words - 1 && max % 64)
+					? (1UL << (max % 64)) - 1
+					: U64_MAX;
+			u64 word = ALOAD(&bitmap[word_idx]);
+			while (true) {
+				u64 free = ~word & valid, take = 0, k = count;
+				while (free && k < n) {
+					u64 low = free & (~free + 1);
+					take |= low;
+					free ^= low;
+					k++;
+				}
+				if (!take) break;
+				/* One CAS claims every bit we need from this
+				 * word */
+				if (alloc_cas(&bitmap[word_idx], &word,
+					      word | take)) {
+					word |= take;
+					while (take) {
+						u64 bit = ctz64(take);
+						out[count++] =
+						    data + (word_idx * 64 + bit) *
+							       slab_size;
+						take &= take - 1;
+					}
+					break;
+				}
+			}
+			if (full_to == word_idx && (word | valid) == word)
+				full_to = word_idx + 1;
+		}
+		if (full_to > first) {
+			u64 expected = first;
+			__cas64(&chunk->last_free, &expected, full_to);
+		}
+		if (count > claimed &&
+		    !slab_chunk_claim(chunk, out + claimed, count - claimed))
+			count = claimed;
+		if (count == n) break;
+		cur = atomic_load_or_allocate_impl(a, &chunk->next, slab_size,
+						   cur);
+	}
+	slab_chain_exit(a, index);
+
+	if (!count) err = ENOMEM;
+	return count;
+}
+
+STATIC void release_slab_batch_impl(Alloc *a, void **ptrs, u64 n) {
+	u64 base_offset = GET_BASE_OFFSET(a), i, j;
+
+	for (i = 0; i < n; i++) {
+		u64 chunk_index, chunk_offset, index, word_idx, mask, slab_size;
+		u64 *word_ptr, expected, slots = 1;
+		Chunk *chunk;
+		void *chunk_base;
+
+		if (!ptrs[i]) continue;
+		GET_CHUNK_INFO((u64)ptrs[i] - base_offset, chunk_index,
+			       chunk_offset, chunk_base);
+		chunk = chunk_base;
+		slab_size = chunk->slab_size;
+		index = (chunk_offset - sizeof(Chunk) - BITMAP_SIZE(slab_size)) /
+			slab_size;
+		word_idx = index >> 6;
+		mask = 1UL << (index & 63);
+
+		/* Coalesce the remaining slots that share this bitmap word */
+		for (j = i + 1; j < n; j++) {
+			u64 other;
+			if ((u8 *)ptrs[j] < (u8 *)chunk ||
+			    (u8 *)ptrs[j] >= (u8 *)chunk + CHUNK_SIZE)
+				continue;
+			other = ((u64)ptrs[j] - (u64)chunk - sizeof(Chunk) -
+				 BITMAP_SIZE(slab_size)) /
+				slab_size;
+			if (other >> 6 != word_idx) continue;
+			mask |= 1UL << (other & 63);
+			ptrs[j] = NULL;
+			slots++;
+		}
+
+		word_ptr = (u64 *)((u64)chunk + sizeof(Chunk)) + word_idx;
+		while (true) {
+			u64 old_value = ALOAD(word_ptr);
+			if ((old_value & mask) != mask)
+				panic("Double free or invalid bits!");
+			if (alloc_cas(word_ptr, &old_value, old_value & ~mask))
+				break;
+		}
+		expected = ALOAD(&chunk->last_free);
+		while (expected > word_idx &&
+		       !__cas64(&chunk->last_free, &expected, word_idx))
+			expected = ALOAD(&chunk->last_free);
+		slab_chunk_released(a, chunk, slots);
+	}
+}
+
+STATIC Chunk *slab_chunk_of(Alloc *a, void *ptr) {
+	u64 base_offset, offset, chunk_index, chunk_offset;
+	void *chunk_base;
+
+	if (!a) return NULL;
+	base_offset = GET_BASE_OFFSET(a);
+	if ((u64)ptr < base_offset || (u64)ptr >= base_offset + a->size)
+		return NULL;
+	offset = (u64)ptr - base_offset;
+	GET_CHUNK_INFO(offset, chunk_index, chunk_offset, chunk_base);
+	if (chunk_offset == 0 || chunk_offset == CHUNK_HEADER_OFFSET ||
+	    offset % 8 != 0 || !((Chunk *)chunk_base)->slab_size)
+		return NULL;
+	return chunk_base;
+}
+
+STATIC void *allocate_chunk_run(Alloc *a, u64 count) {
+	u64 bits, res;
+	do {
+		bits = ALOAD(&a->bitmap_bits);
+		res = find_free_bits(CHUNK_BITMAP(a), bits, &a->last_free,
+				     count);
+	} while (res == (u64)-1 && grow_arena(a, bits, count));
 	if (res == (u64)-1) {
 		err = ENOMEM;
 		return NULL;
 	}
-	struct chunk_header *header =
-	    (void *)((u64)a + sizeof(Alloc) + a->bitmap_pages * PAGE_SIZE +
-		     CHUNK_SIZE * res);
+	MEMSAN_ADD(CHUNK_SIZE * count);
+	return CHUNK_OFFSET(a) + CHUNK_SIZE * res;
+}
+
+STATIC void *allocate_chunk_multi(Alloc *a, u64 size) {
+	u64 chunks_needed = CHUNKS_NEEDED(size);
+	struct chunk_header *header = allocate_chunk_run(a, chunks_needed);
+
+	if (!header) return NULL;
 	header->size = size;
 	header->chunk_count = chunks_needed;
-	MEMSAN_ADD(CHUNK_SIZE * chunks_needed);
 	return (void *)((u8 *)header + CHUNK_HEADER_OFFSET);
 }
 
-Alloc *alloc_init(AllocType t, u64 size, ...) {
+STATIC LargeObject *large_object_find(Alloc *a, void *ptr) {
+	u64 i;
+	for (i = 0; i < _large_object_count__; i++) {
+		LargeObject *lo = &_large_objects__[i];
+		/* A released entry is free for any arena */
+		if (lo->ptr == ptr && (!ptr || lo->a == a)) return lo;
+	}
+	return NULL;
+}
+
+STATIC u64 large_object_length(u64 size, bool hugetlb) {
+	u64 align = hugetlb ? HUGE_PAGE_SIZE : PAGE_SIZE;
+	if (size > U64_MAX - align) return 0;
+	return (size + align - 1) & ~(align - 1);
+}
+
+/* Doubles the table. Only allocate_large_impl() grows it, before it takes an
+ * entry, so no LargeObject pointer is held across a move. */
+STATIC bool large_object_table_grow(void) {
+	u64 capacity = _large_object_capacity__
+			   ? _large_object_capacity__ * 2
+			   : PAGE_SIZE / sizeof(LargeObject);
+	LargeObject *table;
+
+	if (!_large_objects__)
+		table = mmap(NULL, capacity * sizeof(LargeObject),
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+		table = mremap(_large_objects__,
+			       _large_object_capacity__ * sizeof(LargeObject),
+			       capacity * sizeof(LargeObject), MREMAP_MAYMOVE);
+	if (table == MAP_FAILED) {
+		err = ENOMEM;
+		return false;
+	}
+	_large_objects__ = table;
+	_large_object_capacity__ = capacity;
+	return true;
+}
+
+STATIC void *allocate_large_impl(Alloc *a, u64 size) {
+	LargeObject *lo;
+	void *ptr = MAP_FAILED;
+	i32 flags, save;
+	bool hugetlb = false;
+	u64 mapped;
+
+	if (!(lo = large_object_find(a, NULL))) {
+		if (_large_object_count__ == _large_object_capacity__ &&
+		    !large_object_table_grow())
+			return NULL;
+		lo = &_large_objects__[_large_object_count__];
+	}
+
+	flags = MAP_ANONYMOUS |
+		(a->type == ALLOC_TYPE_MAP ? MAP_PRIVATE : MAP_SHARED);
+	/* Follow the arena's backing; map_arena() already dropped the flag if
+	 * no huge pages were reserved */
+	if ((a->flags & ALLOC_FLAG_HUGETLB) &&
+	    (mapped = large_object_length(size, true))) {
+		ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+			   flags | MAP_HUGETLB, -1, 0);
+		hugetlb = ptr != MAP_FAILED;
+	}
+	if (!hugetlb) {
+		if (!(mapped = large_object_length(size, false))) {
+			err = ENOMEM;
+			return NULL;
+		}
+		ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (ptr == MAP_FAILED) return NULL;
+		/* Transparent huge pages are only a hint */
+		save = err;
+		if (madvise(ptr, mapped, MADV_HUGEPAGE) < 0) err = save;
+	}
+
+	if (lo == &_large_objects__[_large_object_count__])
+		_large_object_count__++;
+	lo->a = a;
+	lo->ptr = ptr;
+	lo->mapped = mapped;
+	lo->hugetlb = hugetlb;
+	MEMSAN_ADD(mapped);
+	return ptr;
+}
+
+STATIC void release_large_impl(Alloc *a __attribute__((unused)),
+			       LargeObject *lo) {
+	munmap(lo->ptr, lo->mapped);
+	MEMSAN_SUB(lo->mapped);
+	lo->ptr = NULL;
+	lo->a = NULL;
+	lo->mapped = 0;
+}
+
+STATIC u64 arena_length(Alloc *a) {
+	u64 length = a->size + sizeof(Alloc) + a->bitmap_pages * PAGE_SIZE;
+	if (a->flags & ALLOC_FLAG_HUGETLB)
+		length = (length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	return length;
+}
+
+/* Maps an anonymous arena and applies the backing hints in *flags, clearing
+ * the ones the kernel refused. Only the first `committed` bytes are
+ * pre-faulted so a reservation stays lazy. */
+STATIC void *map_arena(AllocType t, u64 length, u64 committed, bool reserve,
+		       u32 *flags) {
+	i32 mflags = MAP_ANONYMOUS |
+		     (t == ALLOC_TYPE_MAP ? MAP_PRIVATE : MAP_SHARED);
+	void *ret = MAP_FAILED;
+	i32 save = err;
+
+	if (*flags & ALLOC_FLAG_HUGETLB) {
+		u64 huge = (length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		/* Reserving the whole range would need that many huge pages
+		 * up front, so fault in the committed part now and leave the
+		 * rest to grow_arena() */
+		ret = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+			   mflags | MAP_HUGETLB | (reserve ? MAP_NORESERVE : 0),
+			   -1, 0);
+		if (ret != MAP_FAILED && reserve &&
+		    arena_populate(ret, 0, committed) < 0) {
+			munmap(ret, huge);
+			ret = MAP_FAILED;
+		}
+		/* No huge pages reserved, use transparent ones instead */
+		if (ret == MAP_FAILED)
+			*flags = (*flags & ~ALLOC_FLAG_HUGETLB) | ALLOC_FLAG_THP;
+	}
+	if (ret == MAP_FAILED) {
+		/* Untouched pages of an anonymous mapping are never committed,
+		 * so reserving the whole range up front costs no memory */
+		if (reserve) mflags |= MAP_NORESERVE;
+		ret = mmap(NULL, length, PROT_READ | PROT_WRITE, mflags, -1, 0);
+		if (ret == MAP_FAILED) return NULL;
+	}
+
+	if ((*flags & ALLOC_FLAG_THP) &&
+	    madvise(ret, length, MADV_HUGEPAGE) < 0)
+		*flags &= ~ALLOC_FLAG_THP;
+	if (*flags & ALLOC_FLAG_NUMA_INTERLEAVE) {
+		/* The kernel masks this down to the nodes we may use */
+		u64 nodes = U64_MAX;
+		if (mbind(ret, length, MPOL_INTERLEAVE, &nodes, 64, 0) < 0)
+			*flags &= ~ALLOC_FLAG_NUMA_INTERLEAVE;
+	} else if ((*flags & ALLOC_FLAG_NUMA_LOCAL) &&
+		   mbind(ret, length, MPOL_LOCAL, NULL, 0, 0) < 0) {
+		*flags &= ~ALLOC_FLAG_NUMA_LOCAL;
+	}
+	/* Fault in after mbind so the pages follow the policy */
+	if ((*flags & ALLOC_FLAG_POPULATE) &&
+	    madvise(ret, committed, MADV_POPULATE_WRITE) < 0) {
+		u64 off;
+		for (off = 0; off < committed; off += 4096)
+			((volatile u8 *)ret)[off] = 0;
+	}
+	err = save;
+	return ret;
+}
+
+STATIC Alloc *alloc_init_impl(AllocType t, u64 size, u64 max_size, i32 fd,
+			      u32 flags) {
 	Alloc *ret = NULL;
 	i32 i;
 	u64 bitmap_bits = size / CHUNK_SIZE;
-	u64 bitmap_bytes = (bitmap_bits + 7) / 8;
+	u64 max_bits = max_size / CHUNK_SIZE;
+	u64 bitmap_bytes = (max_bits + 7) / 8;
 	u64 bitmap_pages = (bitmap_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+	u64 header = sizeof(Alloc) + bitmap_pages * PAGE_SIZE;
 
-	if (size < CHUNK_SIZE) {
+	if (size < CHUNK_SIZE || max_size < size ||
+	    (t == ALLOC_TYPE_FMAP && flags)) {
 		err = EINVAL;
 		return NULL;
 	}
 
-	if (t == ALLOC_TYPE_MAP) {
-		ret = map(size + sizeof(Alloc) + bitmap_pages * PAGE_SIZE);
-	} else if (t == ALLOC_TYPE_SMAP) {
-		ret = smap(size + sizeof(Alloc) + bitmap_pages * PAGE_SIZE);
-	} else if (t == ALLOC_TYPE_FMAP) {
-		i32 fd;
-		__builtin_va_list list;
-		__builtin_va_start(list, size);
-		fd = (i32) __builtin_va_arg(list, i32);
-		__builtin_va_end(list);
-		ret = fmap(fd, size + sizeof(Alloc) + bitmap_pages * PAGE_SIZE,
-			   0);
-	} else {
-		err = EINVAL;
-	}
+	if (t == ALLOC_TYPE_FMAP)
+		ret = fmap(fd, max_size + header, 0);
+	else
+		ret = map_arena(t, max_size + header, size + header,
+				max_bits > bitmap_bits, &flags);
 	if (!ret) return NULL;
 
 	ret->bitmap_bits = bitmap_bits;
 	ret->bitmap_bytes = bitmap_bytes;
 	ret->bitmap_pages = bitmap_pages;
-	ret->size = size;
-	for (i = 0; i < MAX_SLAB_SIZES; i++) ret->slab_pointers[i] = (u64)-1;
+	ret->size = max_size;
+	ret->max_bits = max_bits;
+	for (i = 0; i < MAX_SLAB_SIZES; i++) {
+		ret->slab_pointers[i] = (u64)-1;
+		ret->slab_walkers[i] = 0;
+		ret->slab_retired[i] = (u64)-1;
+		ret->slab_reclaimers[i] = 0;
+	}
 	ret->last_free = 0;
+	ret->type = t;
+	ret->flags = flags;
 #if MEMSAN == 1
 	ret->allocated_bytes = 0;
 #endif
 	return ret;
 }
 
+Alloc *alloc_init(AllocType t, u64 size, ...) {
+	__builtin_va_list list;
+	AllocType type = t & ~ALLOC_INIT_FLAGS;
+	i32 fd = -1;
+	u32 flags = 0;
+
+	if (type != ALLOC_TYPE_MAP && type != ALLOC_TYPE_SMAP &&
+	    type != ALLOC_TYPE_FMAP) {
+		err = EINVAL;
+		return NULL;
+	}
+	__builtin_va_start(list, size);
+	if (type == ALLOC_TYPE_FMAP) fd = (i32) __builtin_va_arg(list, i32);
+	if (t & ALLOC_INIT_FLAGS) flags = (u32) __builtin_va_arg(list, u32);
+	__builtin_va_end(list);
+	return alloc_init_impl(type, size, size, fd, flags);
+}
+
+Alloc *alloc_init_growable(AllocType t, u64 size, u64 max_size, ...) {
+	AllocType type = t & ~ALLOC_INIT_FLAGS;
+	u32 flags = 0;
+
+	if (type != ALLOC_TYPE_MAP && type != ALLOC_TYPE_SMAP) {
+		err = EINVAL;
+		return NULL;
+	}
+	if (t & ALLOC_INIT_FLAGS) {
+		__builtin_va_list list;
+		__builtin_va_start(list, max_size);
+		flags = (u32) __builtin_va_arg(list, u32);
+		__builtin_va_end(list);
+	}
+	return alloc_init_impl(type, size, max_size, -1, flags);
+}
+
 void alloc_destroy(Alloc *a) {
-	munmap(a, a->size + sizeof(Alloc) + a->bitmap_pages * PAGE_SIZE);
+	u64 i;
+	for (i = 0; i < _large_object_count__; i++)
+		if (_large_objects__[i].a == a && _large_objects__[i].ptr)
+			release_large_impl(a, &_large_objects__[i]);
+	munmap(a, arena_length(a));
 }
 
 u64 allocated_bytes_impl(Alloc *a __attribute__((unused))) {
@@ -394,16 +1038,14 @@ void reset_allocated_bytes_impl(Alloc *a __attribute__((unused))) {
 #endif
 }
 
-void *alloc_impl(Alloc *a, u64 size) {
-	void *ret = NULL;
-
+STATIC bool debug_alloc_failure(void) {
 #if TEST == 1
 	u64 cur, bypass;
 	if (!(bypass = ALOAD(&_debug_alloc_failure_bypass_count))) {
 		while ((cur = ALOAD(&_debug_alloc_failure))) {
 			u64 exp = cur;
 			if (__cas64(&_debug_alloc_failure, &exp, cur - 1)) {
-				return NULL;
+				return true;
 			}
 		}
 	} else {
@@ -411,12 +1053,15 @@ void *alloc_impl(Alloc *a, u64 size) {
 		__cas64(&_debug_alloc_failure_bypass_count, &exp, bypass - 1);
 	}
 #endif
+	return false;
+}
 
-	if (size > CHUNK_SIZE) {
-		if (size > (CHUNK_SIZE * 64) - CHUNK_HEADER_OFFSET) {
-			err = EINVAL;
-			return NULL;
-		}
+STATIC void *allocate_impl(Alloc *a, u64 size) {
+	void *ret = NULL;
+
+	if (size > MAX_MULTI_CHUNK_SIZE) {
+		ret = allocate_large_impl(a, size);
+	} else if (size > CHUNK_SIZE) {
 		ret = allocate_chunk_multi(a, size);
 	} else if (size > MAX_SLAB_SIZE) {
 		u64 chunk = allocate_chunk_impl(a);
@@ -427,11 +1072,18 @@ void *alloc_impl(Alloc *a, u64 size) {
 			     a->bitmap_pages * PAGE_SIZE + CHUNK_SIZE * chunk);
 	} else {
 		ret = allocate_slab_impl(a, size);
+		if (!ret) _alloc_class_failures__[calculate_slab_index_impl(size)]++;
 	}
 
+	if (!ret) _alloc_failures__++;
 	return ret;
 }
 
+void *alloc_impl(Alloc *a, u64 size) {
+	if (debug_alloc_failure()) return NULL;
+	return allocate_impl(a, size);
+}
+
 void release_impl(Alloc *a, void *ptr) {
 	u64 base_offset, offset, chunk_index, chunk_offset;
 	void *chunk_base;
@@ -444,6 +1096,11 @@ void release_impl(Alloc *a, void *ptr) {
 	base_offset = GET_BASE_OFFSET(a);
 	offset = (u64)ptr - base_offset;
 	if ((u64)ptr < base_offset || (u64)ptr >= base_offset + a->size) {
+		LargeObject *lo = large_object_find(a, ptr);
+		if (lo) {
+			release_large_impl(a, lo);
+			return;
+		}
 		panic("Invalid memory release!");
 		return;
 	}
@@ -451,19 +1108,29 @@ void release_impl(Alloc *a, void *ptr) {
 	GET_CHUNK_INFO(offset, chunk_index, chunk_offset, chunk_base);
 	if (chunk_offset == 0) {
 		/* Single chunk */
-		RELEASE_BITS((void *)((u64)a + sizeof(Alloc)), chunk_index,
-			     &a->last_free, 1);
+		release_bits(CHUNK_BITMAP(a), chunk_index, &a->last_free, 1);
 		MEMSAN_SUB(CHUNK_SIZE);
 	} else if (chunk_offset == CHUNK_HEADER_OFFSET) {
 		/* Multi-chunk */
 		struct chunk_header *header = (struct chunk_header *)chunk_base;
 		u64 bits = header->chunk_count;
-		RELEASE_BITS((void *)((u64)a + sizeof(Alloc)), chunk_index,
-			     &a->last_free, bits);
+		release_bits(CHUNK_BITMAP(a), chunk_index, &a->last_free,
+			     bits);
 		MEMSAN_SUB(CHUNK_SIZE * bits);
 	} else if (offset % 8 != 0) { /* At least 8 byte aligned */
 		panic("Invalid memory release!");
 
+	} else if (!((Chunk *)chunk_base)->slab_size) {
+		/* Aligned chunk run */
+		struct aligned_header *header = chunk_base;
+		u64 bits = header->chunk_count;
+		if (chunk_offset != header->offset) {
+			panic("Invalid memory release!");
+			return;
+		}
+		release_bits(CHUNK_BITMAP(a), chunk_index, &a->last_free,
+			     bits);
+		MEMSAN_SUB(CHUNK_SIZE * bits);
 	} else {
 		/* Slab */
 		Chunk *chunk = (Chunk *)chunk_base;
@@ -471,9 +1138,69 @@ void release_impl(Alloc *a, void *ptr) {
 		u64 slab_size = chunk->slab_size;
 		u64 bitmap_size = BITMAP_SIZE(slab_size);
 		u64 index = ((u64)ptr - ((u64)base + bitmap_size)) / slab_size;
-		RELEASE_BITS(base, index, &chunk->last_free, 1);
+		release_bits(base, index, &chunk->last_free, 1);
 		MEMSAN_SUB(slab_size);
+		slab_chunk_released(a, chunk, 1);
+	}
+}
+
+/* Grows or shrinks a multi-chunk block without moving it. Growth claims the
+ * chunks directly after the block; shrinking keeps the tail until less than
+ * half of it is needed so alternating resizes do not thrash the bitmap. */
+STATIC bool resize_chunk_multi(Alloc *a, struct chunk_header *header,
+			       u64 chunk_index, u64 new_size) {
+	u64 count = header->chunk_count, needed = CHUNKS_NEEDED(new_size);
+	u64 bits, end = chunk_index + needed;
+
+	if (needed <= count) {
+		if (needed * 2 <= count) {
+			release_bits(CHUNK_BITMAP(a), end, &a->last_free,
+				     count - needed);
+			MEMSAN_SUB(CHUNK_SIZE * (count - needed));
+			header->chunk_count = needed;
+		}
+		header->size = new_size;
+		return true;
+	}
+
+	while (end > (bits = ALOAD(&a->bitmap_bits)))
+		if (!grow_arena(a, bits, end - bits)) return false;
+	if (!set_bits(CHUNK_BITMAP(a), chunk_index + count, needed - count))
+		return false;
+	MEMSAN_ADD(CHUNK_SIZE * (needed - count));
+	header->chunk_count = needed;
+	header->size = new_size;
+	return true;
+}
+
+STATIC void *resize_large_impl(Alloc *a, LargeObject *lo, u64 new_size) {
+	void *new_ptr;
+	u64 mapped;
+
+	if (new_size <= MAX_MULTI_CHUNK_SIZE) {
+		/* Shrunk back into the arena */
+		if (!(new_ptr = alloc_impl(a, new_size))) return NULL;
+		memcpy(new_ptr, lo->ptr, new_size);
+		release_large_impl(a, lo);
+		return new_ptr;
+	}
+
+	if (!(mapped = large_object_length(new_size, lo->hugetlb))) {
+		err = ENOMEM;
+		return NULL;
 	}
+	if (mapped == lo->mapped) return lo->ptr;
+	/* Grows in place when the following range is free, otherwise the
+	 * kernel moves the page tables without copying */
+	new_ptr = mremap(lo->ptr, lo->mapped, mapped, MREMAP_MAYMOVE);
+	if (new_ptr == MAP_FAILED) return NULL;
+	if (mapped > lo->mapped)
+		MEMSAN_ADD(mapped - lo->mapped);
+	else
+		MEMSAN_SUB(lo->mapped - mapped);
+	lo->ptr = new_ptr;
+	lo->mapped = mapped;
+	return new_ptr;
 }
 
 void *resize_impl(Alloc *a, void *ptr, u64 new_size) {
@@ -489,15 +1216,11 @@ void *resize_impl(Alloc *a, void *ptr, u64 new_size) {
 		return NULL;
 	}
 
-	/* Validate new size */
-	if (new_size > (CHUNK_SIZE * 64) - CHUNK_HEADER_OFFSET) {
-		err = EINVAL;
-		return NULL;
-	}
-
 	/* Validate pointer */
 	base_offset = GET_BASE_OFFSET(a);
 	if ((u64)ptr < base_offset || (u64)ptr >= base_offset + a->size) {
+		LargeObject *lo = large_object_find(a, ptr);
+		if (lo) return resize_large_impl(a, lo, new_size);
 		panic("Invalid pointer resized!\n");
 		return NULL;
 	}
@@ -518,21 +1241,31 @@ void *resize_impl(Alloc *a, void *ptr, u64 new_size) {
 		/* Multi-chunk allocation (> CHUNK_SIZE) */
 		struct chunk_header *header = (struct chunk_header *)chunk_base;
 		old_size = header->size;
-		if (new_size > CHUNK_SIZE && old_size >= new_size) {
-			return ptr; /* Fits in existing multi-chunk */
+		if (new_size > CHUNK_SIZE && new_size <= MAX_MULTI_CHUNK_SIZE &&
+		    resize_chunk_multi(a, header, chunk_index, new_size)) {
+			return ptr;
 		}
 		ALLOC_AND_COPY(a, new_size, ptr, old_size, new_ptr);
 		if (!new_ptr) return NULL;
 		release_impl(a, ptr); /* Handles multi-bit release */
 		return new_ptr;
+	} else if (!((Chunk *)chunk_base)->slab_size) {
+		/* Aligned chunk run, moved since alignment is not kept */
+		old_size = ((struct aligned_header *)chunk_base)->size;
+		ALLOC_AND_COPY(a, new_size, ptr, old_size, new_ptr);
+		if (!new_ptr) return NULL;
+		release_impl(a, ptr);
+		return new_ptr;
 	} else {
 		/* Slab allocation (<= MAX_SLAB_SIZE) */
 		Chunk *chunk = (Chunk *)chunk_base;
 		u64 old_slab_size = chunk->slab_size;
 		u64 new_slab_size = calculate_slab_size_impl(new_size);
-		old_size = old_slab_size;
+		u64 data = (u64)chunk + sizeof(Chunk) + BITMAP_SIZE(old_slab_size);
+		/* Aligned allocations may start inside their slot */
+		old_size = old_slab_size - ((u64)ptr - data) % old_slab_size;
 
-		if (old_slab_size == new_slab_size) {
+		if (old_slab_size == new_slab_size && new_size <= old_size) {
 			return ptr; /* Same slab size */
 		}
 		ALLOC_AND_COPY(a, new_size, ptr, old_size, new_ptr);
@@ -542,6 +1275,230 @@ void *resize_impl(Alloc *a, void *ptr, u64 new_size) {
 	}
 }
 
+STATIC u64 usable_size_impl(Alloc *a, void *ptr) {
+	u64 base_offset = GET_BASE_OFFSET(a), offset, chunk_index, chunk_offset;
+	void *chunk_base;
+
+	if ((u64)ptr < base_offset || (u64)ptr >= base_offset + a->size) {
+		LargeObject *lo = large_object_find(a, ptr);
+		return lo ? lo->mapped : 0;
+	}
+	offset = (u64)ptr - base_offset;
+	GET_CHUNK_INFO(offset, chunk_index, chunk_offset, chunk_base);
+	if (chunk_offset == 0) return CHUNK_SIZE;
+	if (chunk_offset == CHUNK_HEADER_OFFSET)
+		return ((struct chunk_header *)chunk_base)->chunk_count *
+			   CHUNK_SIZE -
+		       CHUNK_HEADER_OFFSET;
+	if (!((Chunk *)chunk_base)->slab_size)
+		return ((struct aligned_header *)chunk_base)->chunk_count *
+			   CHUNK_SIZE -
+		       chunk_offset;
+	return ((Chunk *)chunk_base)->slab_size;
+}
+
+/* Rounds multi-chunk growth up to a power of two chunks. Slabs are already
+ * power of two classes and large objects grow in place with mremap. */
+STATIC u64 grow_size_impl(u64 size) {
+	u64 chunks;
+	if (size <= CHUNK_SIZE || size > MAX_MULTI_CHUNK_SIZE) return size;
+	chunks = CHUNKS_NEEDED(size);
+	chunks = (u64)1 << (64 - clz64(chunks - 1));
+	return chunks * CHUNK_SIZE - CHUNK_HEADER_OFFSET;
+}
+
+void *resize_hint_impl(Alloc *a, void *ptr, u64 new_size, ResizeHint hint) {
+	if (hint == RESIZE_GROW_POW2 && ptr && new_size &&
+	    new_size > usable_size_impl(a, ptr))
+		new_size = grow_size_impl(new_size);
+	return resize_impl(a, ptr, new_size);
+}
+
+/* Places size bytes at align inside a run of chunks. All chunk bases share
+ * one alignment, so the data offset is known before the run is claimed.
+ * The run may take one chunk more than alloc() would for the same size. */
+STATIC void *allocate_chunk_aligned(Alloc *a, u64 size, u64 align) {
+	u64 base = (u64)CHUNK_OFFSET(a), offset, count;
+	struct aligned_header *header;
+
+	if (size > MAX_MULTI_CHUNK_SIZE) return allocate_large_impl(a, size);
+	offset = ((base + sizeof(struct aligned_header) + align - 1) &
+		  ~(align - 1)) -
+		 base;
+	count = (offset + size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if (!(header = allocate_chunk_run(a, count))) return NULL;
+	header->slab_size = 0;
+	header->offset = offset;
+	header->chunk_count = count;
+	header->size = size;
+	return (u8 *)header + offset;
+}
+
+/* Slab data starts 16 byte aligned and slots are powers of two, so
+ * over-allocating by align - 16 always leaves an aligned start in the slot.
+ * Chunk bases are only as aligned as the arena header leaves them, so
+ * larger requests they do not satisfy move inside a chunk run. */
+STATIC void *alloc_aligned_common(Alloc *a, u64 size, u64 align,
+				  bool magazines) {
+	bool isolated = (align & ALLOC_ISOLATED) != 0;
+	u64 padded;
+	u8 *ptr;
+
+	align &= ~ALLOC_ISOLATED;
+	if (isolated) {
+		if (align < CACHE_LINE_SIZE) align = CACHE_LINE_SIZE;
+		if (size > U64_MAX - CACHE_LINE_SIZE) {
+			err = ENOMEM;
+			return NULL;
+		}
+		/* Whole lines, so no neighbour shares the last one */
+		size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	}
+	if (!size || !align || (align & (align - 1)) || align > 4096) {
+		err = EINVAL;
+		return NULL;
+	}
+
+	padded = align <= 16 ? (size < align ? align : size) : size + align - 16;
+	if (padded <= MAX_SLAB_SIZE) {
+		if (magazines)
+			ptr = alloc(padded);
+		else
+			ptr = alloc_impl(a, padded);
+		if (!ptr) return NULL;
+		return (void *)(((u64)ptr + align - 1) & ~(align - 1));
+	}
+	if (debug_alloc_failure()) return NULL;
+	if (align <= 16) return allocate_impl(a, size);
+	if (size <= CHUNK_SIZE && !((u64)CHUNK_OFFSET(a) & (align - 1)))
+		return allocate_impl(a, MAX_SLAB_SIZE + 1);
+	return allocate_chunk_aligned(a, size, align);
+}
+
+void *alloc_aligned_impl(Alloc *a, u64 size, u64 align) {
+	return alloc_aligned_common(a, size, align, false);
+}
+
+i32 alloc_stats_impl(Alloc *a, AllocStats *stats) {
+	u64 i, word_idx, bits, max_words, run = 0;
+
+	if (!a || !stats) {
+		err = EINVAL;
+		return -1;
+	}
+	memset(stats, 0, sizeof(AllocStats));
+
+	/* Chunk bitmap: usage and free runs */
+	bits = ALOAD(&a->bitmap_bits);
+	max_words = (bits + 63) >> 6;
+	stats->chunks = bits;
+	stats->chunks_reserved = a->max_bits;
+	for (word_idx = 0; word_idx < max_words; word_idx++) {
+		u64 valid = valid_bits(word_idx, bits);
+		u64 used = ALOAD(&CHUNK_BITMAP(a)[word_idx]) & valid;
+		u64 bit;
+		stats->chunks_used += popcount64(used);
+		for (bit = 0; bit < 64 && (valid >> bit) & 1; bit++) {
+			if ((used >> bit) & 1) {
+				run = 0;
+			} else if (!run++) {
+				stats->free_runs++;
+			}
+			if (run > stats->largest_free_run)
+				stats->largest_free_run = run;
+		}
+	}
+
+	/* Slab chains: shared occupancy per size class */
+	for (i = 0; i < MAX_SLAB_SIZES; i++) {
+		AllocClassStats *cs = &stats->classes[i];
+		u64 cur;
+		cs->slab_size = (u64)8 << i;
+		cs->failures = _alloc_class_failures__[i];
+		slab_chain_enter(a, i);
+		cur = ALOAD(&a->slab_pointers[i]);
+		while (cur != (u64)-1) {
+			Chunk *chunk = SLAB_CHUNK(a, cur);
+			u64 *bitmap = (u64 *)((u64)chunk + sizeof(Chunk));
+			u64 max = BITMAP_CAPACITY(chunk->slab_size);
+			cur = ALOAD(&chunk->next);
+			/* Walkers may still pass a chunk that was unlinked */
+			if (ALOAD(&chunk->used) & SLAB_RETIRED) continue;
+			cs->chunks++;
+			cs->slots += max;
+			for (word_idx = 0; word_idx < (max + 63) >> 6; word_idx++)
+				cs->allocated +=
+				    popcount64(ALOAD(&bitmap[word_idx]) &
+					       valid_bits(word_idx, max));
+		}
+		slab_chain_exit(a, i);
+		if (a == _alloc_ptr__ && i < MAGAZINE_CLASSES)
+			cs->cached = _magazines__[i].count;
+		if (cs->chunks) stats->classes_used = i + 1;
+	}
+
+	for (i = 0; i < _large_object_count__; i++) {
+		if (_large_objects__[i].a != a || !_large_objects__[i].ptr)
+			continue;
+		stats->large_objects++;
+		stats->large_bytes += _large_objects__[i].mapped;
+	}
+	stats->failures = _alloc_failures__;
+	stats->reclaimed = _alloc_reclaimed__;
+	stats->cas_retries = _alloc_cas_retries__;
+	stats->flags = a->flags;
+	return 0;
+}
+
+i32 alloc_stats_format(Formatter *f, const AllocStats *stats) {
+	u64 i;
+	if (!f || !stats) {
+		err = EINVAL;
+		return -1;
+	}
+	format(f,
+	       "chunks: used={} committed={} reserved={} free_runs={} "
+	       "largest_free_run={}\n",
+	       stats->chunks_used, stats->chunks, stats->chunks_reserved,
+	       stats->free_runs, stats->largest_free_run);
+	format(f,
+	       "large: objects={} bytes={}\nfailures: {} reclaimed: {} "
+	       "cas_retries: {}\n",
+	       stats->large_objects, stats->large_bytes, stats->failures,
+	       stats->reclaimed, stats->cas_retries);
+	format(f, "backing: flags=0x{x}\n", stats->flags);
+	for (i = 0; i < stats->classes_used; i++) {
+		const AllocClassStats *cs = &stats->classes[i];
+		if (!cs->chunks && !cs->failures) continue;
+		format(f,
+		       "class {}: chunks={} allocated={} free={} cached={} "
+		       "failures={}\n",
+		       cs->slab_size, cs->chunks, cs->allocated,
+		       cs->slots - cs->allocated, cs->cached, cs->failures);
+	}
+	return 0;
+}
+
+/* Sweeps every chain for empty chunks the releases could not retire, e.g.
+ * while the class was busy. Holding the reclaim lock is enough to follow the
+ * links: only the holder unlinks, and appends only touch the tail. */
+u64 alloc_reclaim_impl(Alloc *a) {
+	u64 i, cur, reclaimed = _alloc_reclaimed__;
+
+	if (!a) return 0;
+	for (i = 0; i < MAX_SLAB_SIZES; i++) {
+		if (!slab_reclaim_trylock(a, i)) continue;
+		cur = ALOAD(&a->slab_pointers[i]);
+		while (cur != (u64)-1 && slab_retired_drain(a, i)) {
+			u64 next = ALOAD(&SLAB_CHUNK(a, cur)->next);
+			if (slab_chunk_retire(a, i, cur)) slab_retired_drain(a, i);
+			cur = next;
+		}
+		ASTORE(&a->slab_reclaimers[i], 0);
+	}
+	return _alloc_reclaimed__ - reclaimed;
+}
+
 void *calloc_impl(Alloc *a, u64 nelem, u64 elsize) {
 	void *ret;
 	if (!nelem || !elsize) return NULL;
@@ -563,9 +1520,95 @@ PUBLIC u64 get_allocated_bytes(void) {
 	return allocated_bytes_impl(_alloc_ptr__);
 }
 
-PUBLIC void *alloc(u64 size) { return alloc_impl(_alloc_ptr__, size); }
+PUBLIC void alloc_magazines_flush(void) {
+	void *slots[MAGAZINE_SIZE];
+	u64 i, n;
+	for (i = 0; i < MAGAZINE_CLASSES; i++) {
+		Magazine *m = &_magazines__[i];
+		if (!(n = m->count)) continue;
+		/* Empty the magazine before releasing so a panic during the
+		 * release cannot flush the same slots twice */
+		memcpy(slots, m->slots, n * sizeof(void *));
+		m->count = 0;
+		release_slab_batch_impl(_alloc_ptr__, slots, n);
+	}
+}
+
+PUBLIC void alloc_magazines_reset(void) {
+	u64 i;
+	for (i = 0; i < MAGAZINE_CLASSES; i++) _magazines__[i].count = 0;
+}
+
+PUBLIC void *alloc(u64 size) {
+	Alloc *a = _alloc_ptr__;
+	u64 slab_size, i;
+	Magazine *m;
+
+	if (debug_alloc_failure()) return NULL;
+	if (size > MAGAZINE_MAX_SLAB_SIZE) return allocate_impl(a, size);
+
+	slab_size = calculate_slab_size_impl(size);
+	m = &_magazines__[calculate_slab_index_impl(size)];
+	if (!m->count) {
+		void *batch[MAGAZINE_BATCH];
+		u64 n = allocate_slab_batch_impl(a, slab_size, batch,
+						 MAGAZINE_BATCH);
+		if (!n) {
+			_alloc_class_failures__[calculate_slab_index_impl(
+			    size)]++;
+			_alloc_failures__++;
+			return NULL;
+		}
+		/* Hand out the lowest addresses first */
+		for (i = 0; i < n; i++) m->slots[i] = batch[n - 1 - i];
+		m->count = n;
+	}
+	MEMSAN_ADD(slab_size);
+	return m->slots[--m->count];
+}
 
-PUBLIC void release(void *ptr) { release_impl(_alloc_ptr__, ptr); }
+PUBLIC void release(void *ptr) {
+	Alloc *a = _alloc_ptr__;
+	Chunk *chunk;
+	Magazine *m;
+	u64 data;
+
+	if (!ptr) return;
+	chunk = slab_chunk_of(a, ptr);
+	if (!chunk || chunk->slab_size > MAGAZINE_MAX_SLAB_SIZE) {
+		release_impl(a, ptr);
+		return;
+	}
+
+	/* Cache the slot itself, not an aligned pointer inside it */
+	data = (u64)chunk + sizeof(Chunk) + BITMAP_SIZE(chunk->slab_size);
+	ptr = (void *)(data +
+		       (((u64)ptr - data) & ~((u64)chunk->slab_size - 1)));
+	m = &_magazines__[calculate_slab_index_impl(chunk->slab_size)];
+#if MEMSAN == 1
+	/* Cached slots stay set in the bitmaps, so a double free shows up as
+	 * a clear bit or as a slot this magazine already holds */
+	{
+		u64 i, index = ((u64)ptr - data) / chunk->slab_size;
+		u64 *bitmap = (u64 *)((u64)chunk + sizeof(Chunk));
+		bool bad = !(ALOAD(&bitmap[index >> 6]) & (1UL << (index & 63)));
+		for (i = 0; i < m->count && !bad; i++) bad = m->slots[i] == ptr;
+		if (bad) {
+			panic("Double free or invalid bits!");
+			return;
+		}
+	}
+#endif
+	if (m->count == MAGAZINE_SIZE) {
+		/* Return the oldest half to the shared bitmaps */
+		release_slab_batch_impl(a, m->slots, MAGAZINE_BATCH);
+		memcpy(m->slots, m->slots + MAGAZINE_BATCH,
+		       (MAGAZINE_SIZE - MAGAZINE_BATCH) * sizeof(void *));
+		m->count -= MAGAZINE_BATCH;
+	}
+	MEMSAN_SUB(chunk->slab_size);
+	m->slots[m->count++] = ptr;
+}
 
 PUBLIC void *calloc(u64 nelem, u64 elsize) {
 	return calloc_impl(_alloc_ptr__, nelem, elsize);
@@ -574,3 +1617,20 @@ PUBLIC void *calloc(u64 nelem, u64 elsize) {
 PUBLIC void *resize(void *ptr, u64 size) {
 	return resize_impl(_alloc_ptr__, ptr, size);
 }
+
+PUBLIC void *alloc_aligned(u64 size, u64 align) {
+	return alloc_aligned_common(_alloc_ptr__, size, align, true);
+}
+
+PUBLIC u64 alloc_reclaim(void) {
+	alloc_magazines_flush();
+	return alloc_reclaim_impl(_alloc_ptr__);
+}
+
+PUBLIC i32 alloc_stats(AllocStats *stats) {
+	return alloc_stats_impl(_alloc_ptr__, stats);
+}
+
+PUBLIC void *resize_hint(void *ptr, u64 size, ResizeHint hint) {
+	return resize_hint_impl(_alloc_ptr__, ptr, size, hint);
+}
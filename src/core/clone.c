@@ -23,8 +23,10 @@
  *
  *******************************************************************************/
 
+#include <libfam/alloc.H>
 #include <libfam/format.H>
 #include <libfam/init.H>
+#include <libfam/robust.H>
 #include <libfam/sys.H>
 #include <libfam/syscall.H>
 #include <libfam/syscall_const.H>
@@ -45,6 +47,11 @@ i32 two2(bool share_fds) {
 	args.tls = 0;
 
 	ret = clone3(&args, sizeof(args));
-	if (ret == 0) begin();
+	if (ret == 0) {
+		/* Cached slots belong to the parent */
+		alloc_magazines_reset();
+		robust_list_reset();
+		begin();
+	}
 	return (i32)ret;
 }
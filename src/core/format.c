@@ -30,7 +30,11 @@
 STATIC i32 format_check_resize(Formatter *f, u64 size) {
 	void *tmp;
 	if (f->pos + size > f->capacity) {
-		tmp = resize(f->buf, f->pos + size);
+		if (f->arena)
+			tmp = arena_resize(f->arena, f->buf, f->capacity,
+					   f->pos + size);
+		else
+			tmp = resize(f->buf, f->pos + size);
 		if (!tmp) return -1;
 		f->capacity = f->pos + size;
 		f->buf = tmp;
@@ -156,7 +160,11 @@ PUBLIC const u8 *format_to_string(Formatter *f) {
 
 	/* Ensure buffer is null-terminated */
 	if (f->pos + 1 > f->capacity) {
-		result = resize(f->buf, f->pos + 1);
+		if (f->arena)
+			result = arena_resize(f->arena, f->buf, f->capacity,
+					      f->pos + 1);
+		else
+			result = resize(f->buf, f->pos + 1);
 		if (result == NULL) {
 			return NULL;
 		}
@@ -169,7 +177,7 @@ PUBLIC const u8 *format_to_string(Formatter *f) {
 }
 
 PUBLIC void format_clear(Formatter *f) {
-	if (f->capacity) release(f->buf);
+	if (f->capacity && !f->arena) release(f->buf);
 	f->capacity = f->pos = 0;
 	f->buf = NULL;
 }
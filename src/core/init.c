@@ -23,9 +23,11 @@
  *
  *******************************************************************************/
 
+#include <libfam/alloc.H>
 #include <libfam/error.H>
 #include <libfam/format.H>
 #include <libfam/init.H>
+#include <libfam/lockprof.H>
 #include <libfam/types.H>
 
 #define MAX_EXIT 64
@@ -35,6 +37,9 @@ STATIC i32 has_begun = 0;
 void begin(void) {
 	if (!has_begun) {
 		signals_init();
+#if LOCKPROF == 1
+		lockprof_init();
+#endif /* LOCKPROF */
 		has_begun = 1;
 	}
 }
@@ -59,4 +64,6 @@ void __attribute__((destructor)) execute_exits(void) {
 		exit_fns[i]();
 	}
 	exit_count = 0;
+	/* Hand slots cached by this process back to the shared arena */
+	alloc_magazines_flush();
 }
@@ -102,6 +102,13 @@ bool _debug_fail_clone3 = false;
 #define SYS_pread64 67
 #define SYS_pwrite64 68
 #define SYS_waitid 95
+#define SYS_madvise 233
+#define SYS_mremap 216
+#define SYS_mbind 235
+#define SYS_eventfd2 19
+#define SYS_futex_waitv 449
+#define SYS_set_robust_list 99
+#define SYS_memfd_create 279
 
 #define SYSCALL_EXIT                 \
 	__asm__ volatile(            \
@@ -181,6 +188,13 @@ static __inline__ i64 raw_syscall(i64 sysno, i64 a0, i64 a1, i64 a2, i64 a3,
 #define SYS_pread64 17
 #define SYS_pwrite64 18
 #define SYS_waitid 247
+#define SYS_madvise 28
+#define SYS_mremap 25
+#define SYS_mbind 237
+#define SYS_eventfd2 290
+#define SYS_futex_waitv 449
+#define SYS_set_robust_list 273
+#define SYS_memfd_create 319
 
 #define SYSCALL_EXIT                                     \
 	__asm__ volatile(                                \
@@ -292,6 +306,42 @@ static __inline__ void *syscall_mmap(void *addr, u64 length, i32 prot,
 					(i64)prot, (i64)flags, (i64)fd,
 					(i64)offset);
 }
+static __inline__ void *syscall_mremap(void *old_address, u64 old_size,
+				       u64 new_size, i32 flags) {
+	return (void *)(u64)raw_syscall(SYS_mremap, (i64)old_address,
+					(i64)old_size, (i64)new_size,
+					(i64)flags, 0, 0);
+}
+static __inline__ i32 syscall_madvise(void *addr, u64 length, i32 advice) {
+	return (i32)raw_syscall(SYS_madvise, (i64)addr, (i64)length,
+				(i64)advice, 0, 0, 0);
+}
+static __inline__ i32 syscall_mbind(void *addr, u64 len, i32 mode,
+				    const u64 *nodemask, u64 maxnode,
+				    u32 flags) {
+	return (i32)raw_syscall(SYS_mbind, (i64)addr, (i64)len, (i64)mode,
+				(i64)nodemask, (i64)maxnode, (i64)flags);
+}
+static __inline__ i32 syscall_futex_waitv(struct futex_waitv *waiters,
+					  u32 nr_futexes, u32 flags,
+					  const struct timespec *timeout,
+					  i32 clockid) {
+	return (i32)raw_syscall(SYS_futex_waitv, (i64)waiters, (i64)nr_futexes,
+				(i64)flags, (i64)timeout, (i64)clockid, 0);
+}
+static __inline__ i32 syscall_eventfd2(u32 initval, i32 flags) {
+	return (i32)raw_syscall(SYS_eventfd2, (i64)initval, (i64)flags, 0, 0,
+				0, 0);
+}
+static __inline__ i32 syscall_set_robust_list(struct robust_list_head *head,
+					      u64 len) {
+	return (i32)raw_syscall(SYS_set_robust_list, (i64)head, (i64)len, 0, 0,
+				0, 0);
+}
+static __inline__ i32 syscall_memfd_create(const u8 *name, u32 flags) {
+	return (i32)raw_syscall(SYS_memfd_create, (i64)name, (i64)flags, 0, 0,
+				0, 0);
+}
 static __inline__ i32 syscall_nanosleep(const struct timespec *req,
 					struct timespec *rem) {
 	return (i32)raw_syscall(SYS_nanosleep, (i64)req, (i64)rem, 0, 0, 0, 0);
@@ -562,6 +612,24 @@ i64 futex(u32 *uaddr, i32 futex_op, u32 val, const struct timespec *timeout,
 	i64 ret = syscall_futex(uaddr, futex_op, val, timeout, uaddr2, val3);
 	SET_ERR
 }
+i32 futex_waitv(struct futex_waitv *waiters, u32 nr_futexes, u32 flags,
+		const struct timespec *timeout, i32 clockid) {
+	i32 ret =
+	    syscall_futex_waitv(waiters, nr_futexes, flags, timeout, clockid);
+	SET_ERR
+}
+i32 eventfd(u32 initval, i32 flags) {
+	i32 ret = syscall_eventfd2(initval, flags);
+	SET_ERR
+}
+i32 set_robust_list(struct robust_list_head *head, u64 len) {
+	i32 ret = syscall_set_robust_list(head, len);
+	SET_ERR
+}
+i32 memfd_create(const u8 *name, u32 flags) {
+	i32 ret = syscall_memfd_create(name, flags);
+	SET_ERR
+}
 i32 getrandom(void *buf, u64 len, u32 flags) {
 	u64 total;
 	if (len > 256) {
@@ -588,6 +656,23 @@ void *mmap(void *addr, u64 length, i32 prot, i32 flags, i32 fd, i64 offset) {
 	SET_ERR_I64_VOID_PTR
 }
 
+void *mremap(void *old_address, u64 old_size, u64 new_size, i32 flags) {
+	void *ret;
+	ret = syscall_mremap(old_address, old_size, new_size, flags);
+	SET_ERR_I64_VOID_PTR
+}
+
+i32 madvise(void *addr, u64 length, i32 advice) {
+	i32 ret = syscall_madvise(addr, length, advice);
+	SET_ERR
+}
+
+i32 mbind(void *addr, u64 len, i32 mode, const u64 *nodemask, u64 maxnode,
+	  u32 flags) {
+	i32 ret = syscall_mbind(addr, len, mode, nodemask, maxnode, flags);
+	SET_ERR
+}
+
 i32 nanosleep(const struct timespec *req, struct timespec *rem) {
 	i32 ret = syscall_nanosleep(req, rem);
 	SET_ERR
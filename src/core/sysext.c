@@ -25,6 +25,7 @@
 
 #include <libfam/error.H>
 #include <libfam/init.H>
+#include <libfam/limits.H>
 #include <libfam/sys.H>
 #include <libfam/syscall_const.H>
 
@@ -93,6 +94,38 @@ void *smap(u64 length) {
 	return v;
 }
 
+void *mirror_map(u64 length) {
+	i32 fd, save;
+	u8 *v;
+	if (!length || length > U64_MAX >> 1) {
+		err = EINVAL;
+		return NULL;
+	}
+	if ((fd = memfd_create("mirror", MFD_CLOEXEC)) < 0) return NULL;
+	if (ftruncate(fd, length) < 0) {
+		save = err;
+		close(fd);
+		err = save;
+		return NULL;
+	}
+	v = mmap(NULL, length << 1, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+		 0);
+	if (v != MAP_FAILED &&
+	    (mmap(v, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		  0) == MAP_FAILED ||
+	     mmap(v + length, length, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		save = err;
+		munmap(v, length << 1);
+		err = save;
+		v = MAP_FAILED;
+	}
+	save = err;
+	close(fd);
+	err = save;
+	return v == MAP_FAILED ? NULL : v;
+}
+
 i32 flush(i32 fd) {
 	i32 ret = fdatasync(fd);
 	return ret;
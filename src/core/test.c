@@ -265,12 +265,564 @@ Test(get_memory_bytes) {
 	err = 0;
 	ASSERT_EQ(alloc_init(100, CHUNK_SIZE * 16), NULL, "invalid type");
 	ASSERT_EQ(err, EINVAL, "err");
-	ASSERT_EQ(alloc(CHUNK_SIZE * 64), NULL, "too big");
+	ptr = alloc(CHUNK_SIZE * 64);
+	ASSERT(ptr, "large object");
+	((u8 *)ptr)[0] = 1;
+	((u8 *)ptr)[CHUNK_SIZE * 64 - 1] = 2;
+	release(ptr);
 	ptr = alloc(8);
-	ASSERT_EQ(resize(ptr, CHUNK_SIZE * 64), NULL, "too big");
+	ptr = resize(ptr, CHUNK_SIZE * 64);
+	ASSERT(ptr, "resize to large object");
 	release(ptr);
 }
 
+Test(large_object) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 16);
+	u8 *p1, *p2, *p3;
+	u64 size = CHUNK_SIZE * 64;
+
+	ASSERT(a, "a!=NULL");
+	p1 = alloc_impl(a, size);
+	ASSERT(p1, "p1!=NULL");
+	ASSERT(p1 < (u8 *)a || p1 > (u8 *)a + CHUNK_SIZE * 17, "outside arena");
+	ASSERT_EQ(allocated_bytes_impl(a), MEMSAN ? size : 0, "mapped bytes");
+	p1[0] = 'a';
+	p1[size - 1] = 'z';
+
+	p2 = resize_impl(a, p1, size * 2);
+	ASSERT(p2, "grow");
+	ASSERT_EQ(p2[0], 'a', "contents kept");
+	ASSERT_EQ(p2[size - 1], 'z', "contents kept");
+	p2[size * 2 - 1] = 'y';
+	ASSERT_EQ(resize_impl(a, p2, size * 2 - 1), p2, "same mapping");
+
+	p3 = resize_impl(a, p2, CHUNK_SIZE * 2);
+	ASSERT(p3, "shrink into arena");
+	ASSERT(p3 > (u8 *)a && p3 < (u8 *)a + CHUNK_SIZE * 17, "inside arena");
+	ASSERT_EQ(p3[0], 'a', "contents kept");
+	release_impl(a, p3);
+
+	p1 = alloc_impl(a, size + 1);
+	ASSERT(p1, "p1!=NULL");
+	release_impl(a, p1);
+	_debug_no_exit = true;
+	_debug_no_write = true;
+	release_impl(a, p1);
+	_debug_no_write = false;
+	_debug_no_exit = false;
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+
+	p1 = alloc_impl(a, size);
+	ASSERT(p1, "p1!=NULL");
+	alloc_destroy(a);
+}
+
+Test(large_object_table) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 16);
+	u64 size = CHUNK_SIZE * 64, i;
+	u8 **ptrs;
+
+	ASSERT(a, "a!=NULL");
+	ptrs = alloc_impl(a, 600 * sizeof(u8 *));
+	ASSERT(ptrs, "ptrs!=NULL");
+	/* More objects than the first table page holds */
+	for (i = 0; i < 600; i++) {
+		ptrs[i] = alloc_impl(a, size);
+		ASSERT(ptrs[i], "large alloc");
+		ptrs[i][0] = (u8)i;
+	}
+	for (i = 0; i < 600; i++) {
+		ASSERT_EQ(ptrs[i][0], (u8)i, "contents kept");
+		release_impl(a, ptrs[i]);
+	}
+	release_impl(a, ptrs);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+extern u64 _large_object_count__;
+
+Test(large_object_reuse) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 16);
+	u64 size = CHUNK_SIZE * 64, count, i;
+	void *p;
+
+	ASSERT(a, "a!=NULL");
+	p = alloc_impl(a, size);
+	ASSERT(p, "p!=NULL");
+	release_impl(a, p);
+	count = _large_object_count__;
+	for (i = 0; i < 1000; i++) {
+		p = alloc_impl(a, size);
+		ASSERT(p, "p!=NULL");
+		release_impl(a, p);
+	}
+	ASSERT_EQ(_large_object_count__, count, "slot reused");
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+Test(resize_in_place) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 16);
+	u8 *p, *p2, *q, *r;
+
+	ASSERT(a, "a!=NULL");
+	p = alloc_impl(a, CHUNK_SIZE * 2 - 16);
+	ASSERT(p, "p!=NULL");
+	p[0] = 'x';
+	p[CHUNK_SIZE * 2 - 17] = 'y';
+	ASSERT_EQ(resize_impl(a, p, CHUNK_SIZE * 3 - 16), p, "grow in place");
+	q = alloc_impl(a, CHUNK_SIZE);
+	ASSERT(q, "q!=NULL");
+
+	/* Neighbour is taken */
+	p2 = resize_impl(a, p, CHUNK_SIZE * 5 - 16);
+	ASSERT(p2 && p2 != p, "moved");
+	ASSERT_EQ(p2[0], 'x', "x");
+	ASSERT_EQ(p2[CHUNK_SIZE * 2 - 17], 'y', "y");
+
+	ASSERT_EQ(resize_impl(a, p2, CHUNK_SIZE * 2 - 16), p2, "shrink");
+	ASSERT_EQ(allocated_bytes_impl(a), MEMSAN ? CHUNK_SIZE * 3 : 0,
+		  "tail released");
+
+	r = resize_hint_impl(a, p2, CHUNK_SIZE * 2 + 1, RESIZE_GROW_POW2);
+	ASSERT_EQ(r, p2, "hint grow in place");
+	ASSERT_EQ(allocated_bytes_impl(a), MEMSAN ? CHUNK_SIZE * 5 : 0,
+		  "rounded to 4 chunks");
+	ASSERT_EQ(resize_hint_impl(a, r, CHUNK_SIZE * 4 - 16, RESIZE_GROW_POW2),
+		  r, "headroom");
+	ASSERT_EQ(allocated_bytes_impl(a), MEMSAN ? CHUNK_SIZE * 5 : 0,
+		  "no new chunks");
+	ASSERT_EQ(r[CHUNK_SIZE * 2 - 17], 'y', "y");
+
+	release_impl(a, r);
+	release_impl(a, q);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+Test(alloc_stats) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 8);
+	AllocStats stats;
+	Formatter f = {0};
+	void *s1, *s2, *s3, *c1, *c2, *big;
+	u64 failures;
+
+	ASSERT(a, "a!=NULL");
+	ASSERT(alloc_stats_impl(NULL, &stats), "null alloc");
+	ASSERT(!alloc_stats_impl(a, &stats), "empty");
+	ASSERT_EQ(stats.chunks, 8, "chunks");
+	ASSERT_EQ(stats.chunks_used, 0, "used");
+	ASSERT_EQ(stats.free_runs, 1, "one run");
+	ASSERT_EQ(stats.largest_free_run, 8, "largest");
+	failures = stats.failures;
+
+	s1 = alloc_impl(a, 64);
+	s2 = alloc_impl(a, 64);
+	s3 = alloc_impl(a, 100);
+	c1 = alloc_impl(a, CHUNK_SIZE);
+	c2 = alloc_impl(a, CHUNK_SIZE * 2 - 16);
+	big = alloc_impl(a, CHUNK_SIZE * 64);
+	ASSERT(s1 && s2 && s3 && c1 && c2 && big, "allocs");
+	release_impl(a, c1);
+	ASSERT(!alloc_impl(a, CHUNK_SIZE * 16), "too big");
+
+	ASSERT(!alloc_stats_impl(a, &stats), "stats");
+	ASSERT_EQ(stats.chunks_used, 4, "slab chunks + multi");
+	ASSERT_EQ(stats.free_runs, 2, "hole + tail");
+	ASSERT_EQ(stats.largest_free_run, 3, "tail");
+	ASSERT_EQ(stats.classes[3].slab_size, 64, "64 class");
+	ASSERT_EQ(stats.classes[3].chunks, 1, "64 chunks");
+	ASSERT_EQ(stats.classes[3].allocated, 2, "64 allocated");
+	ASSERT(stats.classes[3].slots > 2, "64 slots");
+	ASSERT_EQ(stats.classes[4].allocated, 1, "128 allocated");
+	ASSERT_EQ(stats.classes_used, 5, "classes used");
+	ASSERT_EQ(stats.large_objects, 1, "large");
+	ASSERT_EQ(stats.large_bytes, CHUNK_SIZE * 64, "large bytes");
+	ASSERT_EQ(stats.failures, failures + 1, "failures");
+
+	ASSERT(!alloc_stats_format(&f, &stats), "format");
+	ASSERT(!strcmpn(format_to_string(&f),
+			"chunks: used=4 committed=8 reserved=8 free_runs=2 "
+			"largest_free_run=3\n",
+			69),
+	       "format line");
+	format_clear(&f);
+
+	release_impl(a, s1);
+	release_impl(a, s2);
+	release_impl(a, s3);
+	release_impl(a, c2);
+	release_impl(a, big);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+Test(slab_reclaim) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 8);
+	AllocStats stats;
+	void *ptrs[9], *chunks[6];
+	u64 reclaimed;
+	i32 i;
+
+	ASSERT(a, "a!=NULL");
+	alloc_stats_impl(a, &stats);
+	reclaimed = stats.reclaimed;
+
+	/* Three MAX_SLAB_SIZE slots per chunk */
+	for (i = 0; i < 9; i++) {
+		ptrs[i] = alloc_impl(a, MAX_SLAB_SIZE);
+		ASSERT(ptrs[i], "slab");
+	}
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 3, "three chunks");
+
+	/* The middle chunk empties first and is unlinked from the chain */
+	for (i = 3; i < 6; i++) release_impl(a, ptrs[i]);
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 2, "middle reclaimed");
+	ASSERT_EQ(stats.reclaimed, reclaimed + 1, "reclaimed 1");
+
+	/* Appenders race on the tail, so it stays linked like the head */
+	for (i = 0; i < 3; i++) release_impl(a, ptrs[i]);
+	for (i = 6; i < 9; i++) release_impl(a, ptrs[i]);
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 2, "head and tail kept");
+	ASSERT_EQ(stats.chunks_used, 2, "two chunks used");
+	ASSERT_EQ(stats.reclaimed, reclaimed + 1, "reclaimed 1");
+	ASSERT_EQ(alloc_reclaim_impl(a), 0, "nothing left");
+
+	/* The kept chunks are reused before the chain grows again */
+	for (i = 0; i < 6; i++) {
+		ptrs[i] = alloc_impl(a, MAX_SLAB_SIZE);
+		ASSERT(ptrs[i], "slab");
+	}
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 2, "no new chunk");
+	for (i = 0; i < 6; i++) release_impl(a, ptrs[i]);
+
+	for (i = 0; i < 6; i++) {
+		chunks[i] = alloc_impl(a, CHUNK_SIZE);
+		ASSERT(chunks[i], "chunk reusable");
+	}
+	for (i = 0; i < 6; i++) release_impl(a, chunks[i]);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+bool slab_reclaim_trylock(Alloc *a, u64 index);
+void slab_chain_enter(Alloc *a, u64 index);
+
+Test(slab_reclaim_dead_process) {
+	Alloc *a = alloc_init(ALLOC_TYPE_SMAP, CHUNK_SIZE * 8);
+	AllocStats stats;
+	void *ptrs[12];
+	u64 reclaimed;
+	i32 i, pid;
+
+	ASSERT(a, "a!=NULL");
+	for (i = 0; i < 9; i++) {
+		ptrs[i] = alloc_impl(a, MAX_SLAB_SIZE);
+		ASSERT(ptrs[i], "slab");
+	}
+	alloc_stats_impl(a, &stats);
+	reclaimed = stats.reclaimed;
+
+	/* A reclaimer that died holding the class is taken over */
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		slab_reclaim_trylock(a, 17);
+		exit(0);
+	}
+	for (i = 3; i < 6; i++) release_impl(a, ptrs[i]);
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 2, "middle reclaimed");
+	ASSERT_EQ(stats.reclaimed, reclaimed + 1, "lock taken over");
+
+	/* A walker that died on the chain only holds back the retired chunk */
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		slab_chain_enter(a, 17);
+		exit(0);
+	}
+	for (i = 3; i < 6; i++) {
+		ptrs[i] = alloc_impl(a, MAX_SLAB_SIZE);
+		ASSERT(ptrs[i], "slab");
+	}
+	for (i = 6; i < 9; i++) release_impl(a, ptrs[i]);
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ(stats.classes[17].chunks, 2, "old tail unlinked");
+	ASSERT_EQ(stats.chunks_used, 3, "old tail held back");
+	ASSERT_EQ(stats.reclaimed, reclaimed + 1, "not handed back");
+
+	for (i = 6; i < 12; i++) {
+		ptrs[i] = alloc_impl(a, MAX_SLAB_SIZE);
+		ASSERT(ptrs[i], "slab");
+	}
+	for (i = 0; i < 12; i++) release_impl(a, ptrs[i]);
+	alloc_destroy(a);
+}
+
+u32 get_memory_flags(void);
+
+Test(alloc_aligned_shared) {
+	u64 *shared = smap(sizeof(u64) * 4);
+	u64 sizes[] = {70000, CHUNK_SIZE, CHUNK_SIZE * 3};
+	i32 pid, i;
+
+	ASSERT(shared, "smap");
+	/* Allocated by one child and released by another */
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		for (i = 0; i < 3; i++) {
+			u8 *p = alloc_aligned(sizes[i], 4096);
+			if (p) memset(p, 'x', sizes[i]);
+			shared[i] = (u64)p;
+		}
+		exit(0);
+	}
+	for (i = 0; i < 3; i++) {
+		ASSERT(shared[i], "child alloc");
+		ASSERT(!(shared[i] & 4095), "aligned");
+	}
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		for (i = 0; i < 3; i++) {
+			if (((u8 *)shared[i])[sizes[i] - 1] != 'x') exit(0);
+			release((void *)shared[i]);
+		}
+		shared[3] = 1;
+		exit(0);
+	}
+	ASSERT_EQ(shared[3], 1, "released by sibling");
+	munmap(shared, sizeof(u64) * 4);
+}
+
+Test(alloc_hugetlb_reserve) {
+	u64 committed = CHUNK_SIZE * 4;
+	AllocStats stats;
+	u8 *p, **ptrs;
+	bool pool;
+	Alloc *a;
+	u64 i;
+
+	/* Without MAP_NORESERVE the kernel reserves the pages at mmap */
+	p = mmap(NULL, committed, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	pool = p != MAP_FAILED;
+	if (pool) munmap(p, committed);
+
+	/* A reservation far larger than any pool */
+	a = alloc_init_growable(ALLOC_TYPE_MAP | ALLOC_INIT_FLAGS,
+				CHUNK_SIZE * 2, CHUNK_SIZE * 4096,
+				ALLOC_FLAG_HUGETLB);
+	ASSERT(a, "a!=NULL");
+	alloc_stats_impl(a, &stats);
+	ASSERT_EQ((stats.flags & ALLOC_FLAG_HUGETLB) != 0, pool,
+		  "hugetlb kept");
+	/* Growth stops with NULL, not SIGBUS, once a small pool runs out */
+	ptrs = alloc_impl(a, 64 * sizeof(u8 *));
+	ASSERT(ptrs, "ptrs!=NULL");
+	for (i = 0; i < 64 && (ptrs[i] = alloc_impl(a, CHUNK_SIZE)); i++)
+		ptrs[i][CHUNK_SIZE - 1] = 1;
+	ASSERT(i > 0, "grew");
+	while (i--) release_impl(a, ptrs[i]);
+	release_impl(a, ptrs);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+}
+
+Test(alloc_init_flags) {
+	Alloc *a;
+	AllocStats stats;
+	u8 *p;
+
+	a = alloc_init(ALLOC_TYPE_MAP | ALLOC_INIT_FLAGS, CHUNK_SIZE * 4,
+		       ALLOC_FLAG_THP | ALLOC_FLAG_POPULATE |
+			   ALLOC_FLAG_NUMA_LOCAL);
+	ASSERT(a, "a!=NULL");
+	alloc_stats_impl(a, &stats);
+	ASSERT(stats.flags & ALLOC_FLAG_POPULATE, "populated");
+	p = alloc_impl(a, CHUNK_SIZE);
+	ASSERT(p, "p!=NULL");
+	p[CHUNK_SIZE - 1] = 1;
+	release_impl(a, p);
+	alloc_destroy(a);
+
+	/* Falls back to transparent huge pages without a hugetlb pool */
+	a = alloc_init_growable(ALLOC_TYPE_SMAP | ALLOC_INIT_FLAGS,
+				CHUNK_SIZE * 4, CHUNK_SIZE * 8,
+				ALLOC_FLAG_HUGETLB | ALLOC_FLAG_NUMA_INTERLEAVE);
+	ASSERT(a, "a!=NULL");
+	alloc_stats_impl(a, &stats);
+	ASSERT(!(stats.flags & ALLOC_FLAG_HUGETLB) ||
+		   !(stats.flags & ALLOC_FLAG_THP),
+	       "hugetlb or thp");
+	p = alloc_impl(a, CHUNK_SIZE * 6 - 16);
+	ASSERT(p, "p!=NULL");
+	p[CHUNK_SIZE * 6 - 17] = 1;
+	release_impl(a, p);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	alloc_destroy(a);
+
+	err = 0;
+	ASSERT(!alloc_init(ALLOC_TYPE_FMAP | ALLOC_INIT_FLAGS, CHUNK_SIZE * 4,
+			   -1, ALLOC_FLAG_THP),
+	       "fmap flags");
+	ASSERT_EQ(err, EINVAL, "einval");
+
+	setenv("SHARED_MEMORY_HUGEPAGES", "thp", true);
+	setenv("SHARED_MEMORY_POPULATE", "1", true);
+	setenv("SHARED_MEMORY_NUMA", "interleave", true);
+	ASSERT_EQ(get_memory_flags(),
+		  ALLOC_FLAG_THP | ALLOC_FLAG_POPULATE |
+		      ALLOC_FLAG_NUMA_INTERLEAVE,
+		  "env flags");
+	setenv("SHARED_MEMORY_HUGEPAGES", "big", true);
+	setenv("SHARED_MEMORY_NUMA", "local", true);
+	_debug_no_write = true;
+	ASSERT_EQ(get_memory_flags(),
+		  ALLOC_FLAG_POPULATE | ALLOC_FLAG_NUMA_LOCAL, "invalid env");
+	_debug_no_write = false;
+	unsetenv("SHARED_MEMORY_HUGEPAGES");
+	unsetenv("SHARED_MEMORY_POPULATE");
+	unsetenv("SHARED_MEMORY_NUMA");
+	ASSERT_EQ(get_memory_flags(), 0, "no env");
+}
+
+Test(growable_arena) {
+	Alloc *a = alloc_init_growable(ALLOC_TYPE_SMAP, CHUNK_SIZE * 4,
+				       CHUNK_SIZE * 32);
+	void *ptrs[32], *multi;
+	u64 *child_ptr = smap(sizeof(u64));
+	i32 i, pid;
+
+	ASSERT(a, "a!=NULL");
+	ASSERT_EQ(alloc_init_growable(ALLOC_TYPE_FMAP, CHUNK_SIZE * 4,
+				      CHUNK_SIZE * 32),
+		  NULL, "fmap cannot grow");
+	ASSERT_EQ(alloc_init_growable(ALLOC_TYPE_SMAP, CHUNK_SIZE * 4,
+				      CHUNK_SIZE * 2),
+		  NULL, "max < size");
+
+	/* Commits past the initial 4 chunks */
+	for (i = 0; i < 8; i++) {
+		ptrs[i] = alloc_impl(a, CHUNK_SIZE);
+		ASSERT(ptrs[i], "grow");
+	}
+	multi = alloc_impl(a, CHUNK_SIZE * 10 - 16);
+	ASSERT(multi, "multi grow");
+
+	/* Growth by a child is visible to the parent */
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		*child_ptr = (u64)alloc_impl(a, CHUNK_SIZE * 12 - 16);
+		exit(0);
+	}
+	ASSERT(*child_ptr, "child grow");
+	for (i = 8; i < 32; i++)
+		if (!(ptrs[i] = alloc_impl(a, CHUNK_SIZE))) break;
+	ASSERT_EQ(i, 10, "reservation exhausted");
+	ASSERT_EQ(err, ENOMEM, "enomem");
+
+	release_impl(a, (void *)*child_ptr);
+	release_impl(a, multi);
+	while (i--) release_impl(a, ptrs[i]);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+	munmap(child_ptr, sizeof(u64));
+	alloc_destroy(a);
+}
+
+Test(alloc_aligned) {
+	Alloc *a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 64), *b;
+	u64 sizes[] = {1,	     24,	 100,	     4000,
+		       70000,	     1024 * 1024, CHUNK_SIZE, CHUNK_SIZE * 3};
+	u64 aligns[] = {8, 16, 64, 256, 4096};
+	u8 *p, *q, *r;
+	u64 i, j;
+
+	ASSERT(a, "a!=NULL");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < sizeof(aligns) / sizeof(aligns[0]); j++) {
+			p = alloc_aligned_impl(a, sizes[i], aligns[j]);
+			ASSERT(p, "aligned alloc");
+			ASSERT(!((u64)p & (aligns[j] - 1)), "aligned");
+			ASSERT(p > (u8 *)a && p < (u8 *)a + CHUNK_SIZE * 66,
+			       "inside arena");
+			memset(p, 0xA, sizes[i]);
+			release_impl(a, p);
+		}
+	}
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released");
+
+	/* Chunk runs aligned past their header */
+	p = alloc_aligned_impl(a, CHUNK_SIZE * 2, 4096);
+	ASSERT(p, "aligned run");
+	ASSERT(!((u64)p & 4095), "run aligned");
+	p[0] = 'a';
+	p[CHUNK_SIZE * 2 - 1] = 'z';
+	_debug_no_exit = true;
+	_debug_no_write = true;
+	release_impl(a, p + 4096);
+	_debug_no_write = false;
+	_debug_no_exit = false;
+	r = resize_impl(a, p, CHUNK_SIZE * 3);
+	ASSERT(r, "resize run");
+	ASSERT_EQ(r[0], 'a', "resize copies");
+	ASSERT_EQ(r[CHUNK_SIZE * 2 - 1], 'z', "resize copies");
+	release_impl(a, r);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released run");
+
+	/* Up to the alloc() limit the run stays in the arena */
+	b = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 66);
+	ASSERT(b, "b!=NULL");
+	p = alloc_aligned_impl(b, MAX_MULTI_CHUNK_SIZE, 4096);
+	ASSERT(p, "limit");
+	ASSERT(p > (u8 *)b && p < (u8 *)b + CHUNK_SIZE * 68, "inside arena");
+	release_impl(b, p);
+	ASSERT_EQ(allocated_bytes_impl(b), 0, "released limit");
+	alloc_destroy(b);
+
+	err = 0;
+	ASSERT(!alloc_aligned_impl(a, 16, 48), "not pow2");
+	ASSERT_EQ(err, EINVAL, "einval");
+	ASSERT(!alloc_aligned_impl(a, 16, 8192), "too large");
+	ASSERT(!alloc_aligned_impl(a, 0, 64), "zero size");
+
+	/* Isolated objects never share a line with their neighbours */
+	p = alloc_aligned_impl(a, 8, ALLOC_ISOLATED);
+	q = alloc_aligned_impl(a, 8, ALLOC_ISOLATED);
+	ASSERT(p && q, "isolated");
+	ASSERT(!((u64)p & (CACHE_LINE_SIZE - 1)), "p line");
+	ASSERT(!((u64)q & (CACHE_LINE_SIZE - 1)), "q line");
+	ASSERT(p + CACHE_LINE_SIZE <= q || q + CACHE_LINE_SIZE <= p,
+	       "own line");
+	memset(p, 'x', 8);
+	r = resize_impl(a, p, 200);
+	ASSERT(r, "resize");
+	ASSERT_EQ(r[7], 'x', "resize copies");
+	release_impl(a, r);
+	release_impl(a, q);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "released isolated");
+	alloc_destroy(a);
+
+	/* The magazine caches the slot start, not the aligned pointer */
+	p = alloc_aligned(100, 256);
+	ASSERT(p, "global aligned");
+	ASSERT(!((u64)p & 255), "global aligned 256");
+	release(p);
+	q = alloc(356);
+	ASSERT(q, "reuse");
+	ASSERT(q <= p && p < q + 512, "slot start");
+	release(q);
+	ASSERT_BYTES(0);
+}
+
 Test(fmap) {
 	const u8 *path = "/tmp/fmap.dat";
 	i32 fd;
@@ -323,6 +875,72 @@ Test(cas_loop) {
 	ASSERT_EQ(_debug_cas_loop, 0, "_debug_cas_loop");
 }
 
+Test(magazine1) {
+	u8 *p1, *p2, *ptrs[200];
+	u64 *child_ptr = smap(sizeof(u64));
+	i32 i, pid;
+
+	alloc_magazines_flush();
+	p1 = alloc(64);
+	p2 = alloc(64);
+	ASSERT(p1, "p1!=NULL");
+	ASSERT(p2, "p2!=NULL");
+	ASSERT_EQ((u64)p2 - (u64)p1, 64, "refill is ascending");
+	release(p2);
+	ASSERT_EQ(alloc(64), p2, "magazine hit");
+
+	/* Overflow the magazine so that it flushes back to the bitmap */
+	for (i = 0; i < 200; i++) {
+		ptrs[i] = alloc(32);
+		ASSERT(ptrs[i], "alloc32");
+		if (i) ASSERT(ptrs[i] != ptrs[i - 1], "unique");
+	}
+	for (i = 0; i < 200; i++) release(ptrs[i]);
+
+	/* A child must not hand out slots cached by the parent */
+	release(p1);
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		*child_ptr = (u64)alloc(64);
+		exit(0);
+	}
+	ASSERT(*child_ptr, "child alloc");
+	ASSERT(*child_ptr != (u64)p1, "parent slot not shared");
+	release((void *)*child_ptr);
+	release(p2);
+
+	alloc_magazines_flush();
+	munmap(child_ptr, sizeof(u64));
+	ASSERT_BYTES(0);
+}
+
+#if MEMSAN == 1
+Test(magazine_double_free) {
+	u8 *p1, *p2, *p3;
+
+	alloc_magazines_flush();
+	p1 = alloc(64);
+	ASSERT(p1, "p1!=NULL");
+	release(p1);
+	_debug_no_exit = true;
+	_debug_no_write = true;
+	release(p1);
+	_debug_no_write = false;
+	_debug_no_exit = false;
+
+	/* The second release must not have cached the slot again */
+	p2 = alloc(64);
+	p3 = alloc(64);
+	ASSERT_EQ(p2, p1, "cached slot reused");
+	ASSERT(p3 != p1, "slot cached once");
+	release(p3);
+	release(p2);
+	alloc_magazines_flush();
+	ASSERT_BYTES(0);
+}
+#endif /* MEMSAN */
+
 Test(format1) {
 	i32 x = 101;
 	Formatter f = {0};
@@ -1349,6 +1967,34 @@ Test(large_multi_chunk) {
 	alloc_destroy(a);
 }
 
+Test(multi_chunk_cross_word) {
+	Alloc *a;
+	u8 *ptrs[60], *p1, *p2;
+	i32 i;
+	a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE * 192);
+	ASSERT(a, "a != NULL");
+	for (i = 0; i < 60; i++) {
+		ptrs[i] = alloc_impl(a, CHUNK_SIZE);
+		ASSERT(ptrs[i], "single chunk");
+	}
+	/* A ten chunk run has to straddle the first bitmap word */
+	p1 = alloc_impl(a, CHUNK_SIZE * 9);
+	ASSERT(p1, "p1 != NULL");
+	ASSERT_EQ(p1, ptrs[59] + CHUNK_SIZE + 16, "run starts at bit 60");
+	/* A full 64 chunk run no longer needs an empty aligned word */
+	p2 = alloc_impl(a, CHUNK_SIZE * 64 - 16);
+	ASSERT(p2, "p2 != NULL");
+	ASSERT_EQ(p2, p1 + CHUNK_SIZE * 10, "run starts at bit 70");
+	release_impl(a, p1);
+	release_impl(a, p2);
+	for (i = 0; i < 60; i++) release_impl(a, ptrs[i]);
+	p1 = alloc_impl(a, CHUNK_SIZE * 64 - 16);
+	ASSERT_EQ(p1, ptrs[0] + 16, "lowest run after release");
+	release_impl(a, p1);
+	ASSERT_EQ(allocated_bytes_impl(a), 0, "alloc=0");
+	alloc_destroy(a);
+}
+
 Test(small_bitmap) {
 	Alloc *a;
 	a = alloc_init(ALLOC_TYPE_MAP, CHUNK_SIZE / 2);
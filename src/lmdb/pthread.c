@@ -30,7 +30,7 @@
 
 typedef unsigned int pthread_key_t;
 typedef int pthread_mutexattr_t;
-typedef u32 pthread_mutex_t;
+typedef RobustLock pthread_mutex_t;
 typedef unsigned int pthread_t;
 
 void *pthread_getspecific(pthread_key_t key __attribute__((unused))) {
@@ -83,12 +83,14 @@ int pthread_mutexattr_init(pthread_mutexattr_t *attr) {
 
 int pthread_mutex_lock(pthread_mutex_t *mutex __attribute__((unused))) {
 	err = SUCCESS;
-	RobustGuardImpl lg __attribute__((unused)) = robust_lock(mutex);
+	/* Parenthesized past the LOCKPROF macro: the guard is dropped here
+	 * and pthread_mutex_unlock could not close a profiled hold */
+	RobustGuardImpl lg __attribute__((unused)) = (robust_lock)(mutex);
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex __attribute__((unused))) {
-	RobustGuardImpl lg;
+	RobustGuardImpl lg = {0};
 	lg.lock = mutex;
 	robustguard_cleanup(&lg);
 	return 0;
@@ -96,13 +98,13 @@ int pthread_mutex_unlock(pthread_mutex_t *mutex __attribute__((unused))) {
 
 int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr
 		       __attribute__((unused))) {
-	if (mutex) *mutex = LOCK_INIT;
+	if (mutex) robust_init(mutex);
 	return 0;
 }
 
 pthread_t pthread_self(void) { return 0; }
 
 LockGuardImpl pthread_mutex_lock_guard(pthread_mutex_t *mutex) {
-	LockGuardImpl ret = wlock(mutex);
+	LockGuardImpl ret = wlock(&mutex->futex);
 	return ret;
 }
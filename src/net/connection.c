@@ -25,16 +25,19 @@
 
 #include <libfam/alloc.H>
 #include <libfam/atomic.H>
+#include <libfam/bytering.H>
 #include <libfam/connection_internal.H>
 #include <libfam/error.H>
 #include <libfam/event.H>
 #include <libfam/format.H>
 #include <libfam/lock.H>
 #include <libfam/misc.H>
+#include <libfam/pool.H>
 #include <libfam/rbtree.H>
 #include <libfam/socket.H>
 #include <libfam/syscall_const.H>
-#include <libfam/vec.H>
+
+#define CONN_FLAG_POOLED (0x1 << 7)
 
 STATIC bool _debug_force_write_buffer = false;
 STATIC bool _debug_force_write_error = false;
@@ -44,13 +47,14 @@ STATIC u64 _debug_connection_wmax = 0;
 typedef struct {
 	u16 port;
 	u32 connection_alloc_overhead;
+	Pool *pool; /* Inbound connections of this acceptor */
 } AcceptorData;
 
 typedef struct {
 	i32 mplex;
 	Lock lock;
-	Vec *rbuf;
-	Vec *wbuf;
+	ByteRing *rbuf;
+	ByteRing *wbuf;
 } ConnectionData;
 
 struct Connection {
@@ -71,8 +75,15 @@ Connection *connection_acceptor(const u8 addr[4], u16 port, u16 backlog,
 	conn->flags = CONN_FLAG_ACCEPTOR;
 	conn->data.acceptor_data.connection_alloc_overhead =
 	    connection_alloc_overhead;
+	conn->data.acceptor_data.pool =
+	    pool_create(sizeof(Connection) + connection_alloc_overhead, 16);
+	if (!conn->data.acceptor_data.pool) {
+		release(conn);
+		return NULL;
+	}
 	pval = socket_listen(&conn->socket, addr, port, backlog);
 	if (pval < 0) {
+		pool_destroy(conn->data.acceptor_data.pool);
 		release(conn);
 		return NULL;
 	}
@@ -106,12 +117,9 @@ Connection *connection_client(const u8 addr[4], u16 port,
 	return client;
 }
 
-Connection *connection_accepted(i32 fd, i32 mplex,
-				u32 connection_alloc_overhead) {
-	Connection *nconn =
-	    alloc(sizeof(Connection) + connection_alloc_overhead);
-	if (!nconn) return NULL;
-	nconn->flags = CONN_FLAG_INBOUND;
+STATIC Connection *connection_accepted_init(Connection *nconn, i32 fd,
+					    i32 mplex, u32 flags) {
+	nconn->flags = CONN_FLAG_INBOUND | flags;
 	nconn->socket = fd;
 	nconn->data.conn_data.wbuf = nconn->data.conn_data.rbuf = NULL;
 	nconn->data.conn_data.mplex = mplex;
@@ -119,9 +127,29 @@ Connection *connection_accepted(i32 fd, i32 mplex,
 	return nconn;
 }
 
+Connection *connection_accepted(i32 fd, i32 mplex,
+				u32 connection_alloc_overhead) {
+	Connection *nconn =
+	    alloc(sizeof(Connection) + connection_alloc_overhead);
+	if (!nconn) return NULL;
+	return connection_accepted_init(nconn, fd, mplex, 0);
+}
+
+Connection *connection_accepted_from(Connection *acceptor, i32 fd,
+				     i32 mplex) {
+	Connection *nconn;
+	if ((acceptor->flags & CONN_FLAG_ACCEPTOR) == 0) {
+		err = EINVAL;
+		return NULL;
+	}
+	nconn = pool_get(acceptor->data.acceptor_data.pool);
+	if (!nconn) return NULL;
+	return connection_accepted_init(nconn, fd, mplex, CONN_FLAG_POOLED);
+}
+
 i32 connection_write(Connection *conn, const void *buf, u64 len) {
 	i64 wlen = 0;
-	u64 capacity, elements;
+	ByteRing *wbuf;
 	ConnectionData *conn_data = &conn->data.conn_data;
 
 	if (conn->flags & CONN_FLAG_ACCEPTOR) {
@@ -163,23 +191,19 @@ i32 connection_write(Connection *conn, const void *buf, u64 len) {
 				return -1;
 			}
 		}
-		capacity = vec_capacity(conn_data->wbuf);
-		elements = vec_size(conn_data->wbuf);
-		if (len + elements < len) {
+		if (len + bytering_size(conn_data->wbuf) < len) {
 			err = EOVERFLOW;
 			return -1;
 		}
-
-		if (capacity < (len + elements) - wlen) {
-			Vec *tmp = vec_resize(conn_data->wbuf, len + elements);
-			if (!tmp) {
-				shutdown(conn->socket, SHUT_RD);
-				conn->flags |= CONN_FLAG_CLOSED;
-				return -1;
-			}
-			conn_data->wbuf = tmp;
-			vec_extend(conn_data->wbuf, (u8 *)buf + wlen,
-				   len - wlen);
+		wbuf = bytering_reserve(conn_data->wbuf, len - wlen);
+		if (wbuf) conn_data->wbuf = wbuf;
+		/* Part of buf may already be on the socket, so a tail that
+		 * cannot be buffered would corrupt the stream */
+		if (!wbuf ||
+		    bytering_write(wbuf, (u8 *)buf + wlen, len - wlen) < 0) {
+			shutdown(conn->socket, SHUT_RD);
+			conn->flags |= CONN_FLAG_CLOSED;
+			return -1;
 		}
 	}
 	return 0;
@@ -188,7 +212,6 @@ i32 connection_write(Connection *conn, const void *buf, u64 len) {
 i32 connection_write_complete(Connection *conn) {
 	ConnectionData *conn_data = &conn->data.conn_data;
 	i64 wlen;
-	u64 cur = 0;
 	i32 sock;
 
 	if (conn->flags & CONN_FLAG_ACCEPTOR) {
@@ -198,23 +221,23 @@ i32 connection_write_complete(Connection *conn) {
 	sock = conn->socket;
 	{
 		LockGuard lg = wlock(&conn_data->lock);
-		u64 elems = vec_size(conn_data->wbuf);
+		ByteRing *wbuf = conn_data->wbuf;
 		if (conn->flags & CONN_FLAG_CLOSED) {
 			err = EIO;
 			return -1;
 		}
 
-		while (cur < elems) {
+		while (bytering_size(wbuf)) {
 			if (_debug_force_write_error) {
 				wlen = -1;
 				err = _debug_write_error_code;
 			} else {
-				u64 wmax = !_debug_connection_wmax
-					       ? elems - cur
-					       : _debug_connection_wmax;
-				wlen = write(
-				    sock, (u8 *)vec_data(conn_data->wbuf) + cur,
-				    wmax);
+				u64 wmax;
+				u8 *span = bytering_readable(wbuf, &wmax);
+				if (_debug_connection_wmax &&
+				    _debug_connection_wmax < wmax)
+					wmax = _debug_connection_wmax;
+				wlen = write(sock, span, wmax);
 			}
 			if (wlen < 0 && err == EAGAIN) break;
 			if (wlen < 0 && err == EINTR) {
@@ -226,23 +249,19 @@ i32 connection_write_complete(Connection *conn) {
 				conn->flags |= CONN_FLAG_CLOSED;
 				return -1;
 			}
-			cur += wlen;
+			bytering_consume(wbuf, wlen);
 			if (_debug_connection_wmax) break;
 		}
 
-		if (cur == elems) {
+		if (!bytering_size(wbuf)) {
 			if (mregister(conn_data->mplex, sock,
 				      MULTIPLEX_FLAG_READ, conn) < 0) {
 				shutdown(sock, SHUT_RD);
 				conn->flags |= CONN_FLAG_CLOSED;
 				return -1;
 			}
-			vec_release(conn_data->wbuf);
+			bytering_release(wbuf);
 			conn_data->wbuf = NULL;
-		} else {
-			u8 *wbuf = vec_data(conn_data->wbuf);
-			memorymove(wbuf, wbuf + cur, elems - cur);
-			vec_truncate(conn_data->wbuf, elems - cur);
 		}
 	}
 	return 0;
@@ -273,14 +292,14 @@ i32 connection_close(Connection *conn) {
 	}
 }
 
-Vec *connection_rbuf(Connection *conn) {
+ByteRing *connection_rbuf(Connection *conn) {
 	if (conn->flags & CONN_FLAG_ACCEPTOR) {
 		err = EINVAL;
 		return NULL;
 	}
 	return conn->data.conn_data.rbuf;
 }
-Vec *connection_wbuf(Connection *conn) {
+ByteRing *connection_wbuf(Connection *conn) {
 	if (conn->flags & CONN_FLAG_ACCEPTOR) {
 		err = EINVAL;
 		return NULL;
@@ -320,12 +339,16 @@ void connection_release(Connection *conn) {
 	ConnectionType ctype = connection_type(conn);
 	connection_close(conn);
 	if (ctype == Inbound || ctype == Outbound) {
-		if (conn->data.conn_data.wbuf)
-			release(conn->data.conn_data.wbuf);
-		if (conn->data.conn_data.rbuf)
-			release(conn->data.conn_data.rbuf);
+		bytering_release(conn->data.conn_data.wbuf);
+		bytering_release(conn->data.conn_data.rbuf);
+	} else {
+		/* Freed once its last accepted connection is put back */
+		pool_destroy(conn->data.acceptor_data.pool);
 	}
-	release(conn);
+	if (conn->flags & CONN_FLAG_POOLED)
+		pool_put(pool_of(conn), conn);
+	else
+		release(conn);
 }
 
 bool connection_is_connected(Connection *conn) {
@@ -340,9 +363,9 @@ void connection_set_is_connected(Connection *conn) {
 	__cas32(&conn->flags, &flags, flags | CONN_FLAG_CONNECT_COMPLETE);
 }
 
-void connection_set_rbuf(Connection *conn, Vec *v) {
+void connection_set_rbuf(Connection *conn, ByteRing *r) {
 	ConnectionType ct = connection_type(conn);
-	if (ct == Inbound || ct == Outbound) conn->data.conn_data.rbuf = v;
+	if (ct == Inbound || ct == Outbound) conn->data.conn_data.rbuf = r;
 }
 
 bool connection_is_closed(Connection *conn) {
@@ -25,6 +25,7 @@
 
 #include <libfam/alloc.H>
 #include <libfam/atomic.H>
+#include <libfam/bytering.H>
 #include <libfam/connection_internal.H>
 #include <libfam/error.H>
 #include <libfam/event.H>
@@ -47,10 +48,18 @@ void __gcov_dump(void);
 
 i32 wakeup_attachment = 0;
 
+typedef struct {
+	Channel channel;
+	OnChannelFn on_message;
+} EvhChannel;
+
 struct Evh {
 	i32 wakeup[2];
 	i32 mplex;
 	i32 stopped;
+	bool started;
+	u32 channel_count;
+	EvhChannel channels[EVH_MAX_CHANNELS];
 	OnRecvFn on_recv;
 	OnAcceptFn on_accept;
 	OnConnectFn on_connect;
@@ -66,6 +75,16 @@ STATIC i32 proc_wakeup(i32 wakeup) {
 	return 0;
 }
 
+STATIC bool is_channel_attachment(Evh *evh, void *attach) {
+	return (u8 *)attach >= (u8 *)evh->channels &&
+	       (u8 *)attach < (u8 *)(evh->channels + EVH_MAX_CHANNELS);
+}
+
+STATIC void proc_channel(Evh *evh, EvhChannel *ec) {
+	channel_event_ack(&ec->channel);
+	ec->on_message(evh->ctx, &ec->channel);
+}
+
 STATIC void proc_acceptor(Evh *evh, Connection *acceptor) {
 	while (true) {
 		Connection *nconn;
@@ -76,11 +95,11 @@ STATIC void proc_acceptor(Evh *evh, Connection *acceptor) {
 			break;
 		}
 
-		nconn = connection_accepted(
-		    fd, evh->mplex, connection_alloc_overhead(acceptor));
+		nconn = connection_accepted_from(acceptor, fd, evh->mplex);
 		if (!nconn || evh_register(evh, nconn) < 0) {
+			/* An inbound connection does not own its socket */
 			close(fd);
-			if (nconn) release(nconn);
+			if (nconn) connection_release(nconn);
 			continue;
 		}
 		evh->on_accept(evh->ctx, nconn);
@@ -94,11 +113,9 @@ STATIC void proc_close(Evh *evh, Connection *conn) {
 }
 
 STATIC i32 check_and_update_rbuf_capacity(Connection *conn) {
-	Vec *rbuf = connection_rbuf(conn);
-	u64 capacity = vec_capacity(rbuf);
-	u64 elements = vec_size(rbuf);
-	if (capacity - elements < MIN_CAPACITY) {
-		Vec *tmp = vec_resize(rbuf, elements + MIN_CAPACITY);
+	ByteRing *rbuf = connection_rbuf(conn);
+	if (bytering_space(rbuf) < MIN_CAPACITY) {
+		ByteRing *tmp = bytering_reserve(rbuf, MIN_CAPACITY);
 		if (!tmp) return -1;
 		connection_set_rbuf(conn, tmp);
 	}
@@ -108,8 +125,9 @@ STATIC i32 check_and_update_rbuf_capacity(Connection *conn) {
 STATIC void proc_read(Evh *evh, Connection *conn) {
 	i64 rlen = 0;
 	i32 socket = connection_socket(conn);
-	Vec *rbuf;
-	u64 capacity, offset;
+	ByteRing *rbuf;
+	u64 span;
+	u8 *dst;
 
 	while (true) {
 		if (check_and_update_rbuf_capacity(conn) < 0) {
@@ -118,18 +136,16 @@ STATIC void proc_read(Evh *evh, Connection *conn) {
 		}
 
 		rbuf = connection_rbuf(conn);
-		capacity = vec_capacity(rbuf);
-		offset = vec_size(rbuf);
+		dst = bytering_writable(rbuf, &span);
 
 		err = 0;
-		rlen = read(socket, (u8 *)vec_data(rbuf) + offset,
-			    capacity - offset);
+		rlen = read(socket, dst, span);
 
 		if (rlen <= 0) {
 			if (err != EAGAIN) proc_close(evh, conn);
 			break;
 		}
-		vec_set_size(rbuf, offset + rlen);
+		bytering_commit(rbuf, rlen);
 		evh->on_recv(evh->ctx, conn, rlen);
 	}
 }
@@ -162,6 +178,8 @@ STATIC void event_loop(Evh *evh) {
 			Connection *conn = event_attachment(events[i]);
 			if (conn == (Connection *)&wakeup_attachment) {
 				if (proc_wakeup(wakeup) == -1) goto end_while;
+			} else if (is_channel_attachment(evh, conn)) {
+				proc_channel(evh, (EvhChannel *)conn);
 			} else {
 				if (connection_type(conn) == Acceptor) {
 					proc_acceptor(evh, conn);
@@ -209,6 +227,31 @@ i32 evh_register(Evh *evh, Connection *conn) {
 	}
 }
 
+i32 evh_register_channel(Evh *evh, Channel *channel, OnChannelFn on_message) {
+	EvhChannel *ec;
+	i32 fd;
+
+	if (!evh || !channel_ok(channel) || !on_message) {
+		err = EINVAL;
+		return -1;
+	}
+	if (evh->started) {
+		err = EBUSY;
+		return -1;
+	}
+	if (evh->channel_count == EVH_MAX_CHANNELS) {
+		err = ENOSPC;
+		return -1;
+	}
+	if ((fd = channel_eventfd(channel)) < 0) return -1;
+	ec = &evh->channels[evh->channel_count];
+	ec->channel = *channel;
+	ec->on_message = on_message;
+	if (mregister(evh->mplex, fd, MULTIPLEX_FLAG_READ, ec) < 0) return -1;
+	evh->channel_count++;
+	return 0;
+}
+
 Evh *evh_init(EvhConfig *config) {
 	Evh *ret;
 	if (!config || !config->on_recv || !config->on_accept ||
@@ -242,6 +285,8 @@ Evh *evh_init(EvhConfig *config) {
 	ret->on_connect = config->on_connect;
 	ret->on_close = config->on_close;
 	ret->stopped = 0;
+	ret->started = false;
+	ret->channel_count = 0;
 
 	return ret;
 }
@@ -253,8 +298,12 @@ i32 evh_start(Evh *evh) {
 		return -1;
 	}
 
+	evh->started = true;
 	pid = two();
-	if (pid < 0) return -1;
+	if (pid < 0) {
+		evh->started = false;
+		return -1;
+	}
 	if (pid == 0) event_loop(evh);
 
 	return 0;
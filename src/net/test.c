@@ -25,6 +25,7 @@
 
 #include <libfam/alloc.H>
 #include <libfam/atomic.H>
+#include <libfam/bytering.H>
 #include <libfam/channel.H>
 #include <libfam/connection_internal.H>
 #include <libfam/error.H>
@@ -35,7 +36,6 @@
 #include <libfam/syscall.H>
 #include <libfam/syscall_const.H>
 #include <libfam/test.H>
-#include <libfam/vec.H>
 #include <libfam/ws.H>
 
 u8 LOCALHOST[4] = {127, 0, 0, 1};
@@ -420,7 +420,7 @@ Test(conn5) {
 	i32 fd, mplex;
 	u8 buf[10];
 	u16 port;
-	Vec *v;
+	ByteRing *r;
 	ASSERT(c1, "c1!=NULL");
 
 	mplex = multiplex();
@@ -452,12 +452,12 @@ Test(conn5) {
 
 	_debug_force_write_buffer = false;
 
-	v = connection_rbuf(c2);
-	ASSERT(!v, "connection_rbuf1");
-	v = vec_resize(v, 100);
-	connection_set_rbuf(c2, v);
-	v = connection_rbuf(c2);
-	ASSERT(v, "connection_rbuf2");
+	r = connection_rbuf(c2);
+	ASSERT(!r, "connection_rbuf1");
+	r = bytering_reserve(r, 100);
+	connection_set_rbuf(c2, r);
+	r = connection_rbuf(c2);
+	ASSERT(r, "connection_rbuf2");
 
 	close(connection_socket(c2));
 	close(connection_socket(c3));
@@ -479,9 +479,9 @@ void evh1_on_accept(void *ctx, Connection *conn) {
 }
 
 void evh1_on_recv(void *ctx, Connection *conn, u64 rlen) {
-	Vec *rbuf = connection_rbuf(conn);
-	u64 offset = vec_size(rbuf);
-	u8 *data = vec_data(rbuf);
+	ByteRing *rbuf = connection_rbuf(conn);
+	u64 offset = bytering_size(rbuf);
+	u8 *data = bytering_linearize(rbuf);
 	ASSERT_EQ(*((i32 *)ctx), 102, "ctx==102");
 	ASSERT_EQ(rlen, 1, "rlen=1");
 	ASSERT_EQ(offset, 1, "offset=1");
@@ -580,6 +580,51 @@ Test(evh2) {
 	ASSERT_BYTES(0);
 }
 
+u64 *evh_channel_sum = NULL;
+
+void evh_channel_on_message(void *ctx, Channel *channel) {
+	u64 v;
+	ASSERT_EQ(*((i32 *)ctx), 102, "ctx==102");
+	while (!recv_now(channel, &v)) __add64(evh_channel_sum, v);
+}
+
+Test(evh_channel) {
+	i32 ctx = 102;
+	Evh *evh1;
+	Channel ch = channel(sizeof(u64));
+	EvhConfig config = {&ctx, evh1_on_recv, evh1_on_accept, evh1_on_connect,
+			    evh1_on_close};
+	u64 i;
+
+	evh_channel_sum = alloc(sizeof(u64));
+	ASSERT(evh_channel_sum, "evh_channel_sum");
+	*evh_channel_sum = 0;
+
+	evh1 = evh_init(&config);
+	ASSERT(evh1, "evh_init");
+	ASSERT(evh_register_channel(evh1, &ch, NULL), "no handler");
+	ASSERT(!evh_register_channel(evh1, &ch, evh_channel_on_message),
+	       "register");
+	ASSERT(!evh_start(evh1), "start evh");
+	ASSERT(evh_register_channel(evh1, &ch, evh_channel_on_message),
+	       "started");
+	ASSERT_EQ(err, EBUSY, "ebusy");
+
+	for (i = 1; i <= 100; i++) {
+		while (send(&ch, &i) < 0) yield();
+		if (i % 10 == 0) sleep(1);
+	}
+	while (ALOAD(evh_channel_sum) < 5050) yield();
+	ASSERT_EQ(ALOAD(evh_channel_sum), 5050, "sum");
+
+	ASSERT(!evh_stop(evh1), "stop evh");
+	evh_destroy(evh1);
+	channel_destroy(&ch);
+	release(evh_channel_sum);
+
+	ASSERT_BYTES(0);
+}
+
 Test(evh_fail) {
 	i32 ctx = 1;
 	EvhConfig config1 = {0};
@@ -915,3 +960,115 @@ Test(ws_simple) {
 	/* Assert that there were no memory leaks. */
 	ASSERT_BYTES(0);
 }
+
+u64 *ws_pipe_count;
+u64 *ws_pipe_bad;
+u64 *ws_pipe_closed;
+
+void ws_pipe_on_message(Ws *ws, WsConnection *conn, WsMessage *msg) {
+	u64 i;
+	ASSERT(ws && conn, "non-null");
+	for (i = 0; i < msg->len; i++)
+		if (msg->buffer[i] != (u8)(msg->len + i)) {
+			__add64(ws_pipe_bad, 1);
+			break;
+		}
+	__add64(ws_pipe_count, 1);
+}
+
+void ws_pipe_on_close(Ws *ws, WsConnection *conn) {
+	ASSERT(ws && conn, "non-null");
+	__add64(ws_pipe_closed, 1);
+}
+
+/* Writes a masked binary frame of len bytes to out and returns its size */
+STATIC u64 ws_pipe_frame(u8 *out, u64 len) {
+	u8 key[4] = {0x12, 0x34, 0x56, 0x78};
+	u64 i, off = 2;
+	out[0] = 0x82;
+	if (len <= 125)
+		out[1] = 0x80 | (u8)len;
+	else if (len <= 65535) {
+		out[1] = 0x80 | 126;
+		out[2] = (len >> 8) & 0xFF;
+		out[3] = len & 0xFF;
+		off = 4;
+	} else {
+		out[1] = 0x80 | 127;
+		for (i = 0; i < 8; i++) out[2 + i] = (len >> (56 - i * 8)) & 0xFF;
+		off = 10;
+	}
+	memcpy(out + off, key, 4);
+	off += 4;
+	for (i = 0; i < len; i++) out[off + i] = (u8)(len + i) ^ key[i % 4];
+	return off + len;
+}
+
+STATIC void ws_pipe_write(i32 fd, const u8 *buf, u64 len) {
+	while (len) {
+		i64 w = write(fd, buf, len);
+		if (w < 0) {
+			ASSERT_EQ(err, EAGAIN, "EAGAIN");
+			continue;
+		}
+		buf += w;
+		len -= w;
+	}
+}
+
+/* Many small frames arriving in one read and one large frame arriving in
+ * pieces */
+Test(ws_pipelined) {
+	const u8 *handshake =
+	    "GET / HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	    "\r\n";
+	WsConfig config = {0};
+	u8 frames[4096], resp[512];
+	u64 i, off = 0, rlen = 0, big_len;
+	u8 *big;
+	i32 fd;
+	Ws *ws;
+
+	ws_pipe_count = alloc(sizeof(u64));
+	ws_pipe_bad = alloc(sizeof(u64));
+	ws_pipe_closed = alloc(sizeof(u64));
+	*ws_pipe_count = *ws_pipe_bad = *ws_pipe_closed = 0;
+
+	config.on_message = ws_pipe_on_message;
+	config.on_close = ws_pipe_on_close;
+	ws = ws_init(&config);
+	ASSERT(ws, "ws_init");
+	ASSERT(!ws_start(ws), "ws_start");
+	fd = test_connect(LOCALHOST, ws_port(ws));
+	ASSERT(fd >= 0, "connect");
+
+	ws_pipe_write(fd, handshake, strlen(handshake));
+	while (!substrn(resp, "\r\n\r\n", rlen)) {
+		i64 r = read(fd, resp + rlen, sizeof(resp) - rlen);
+		if (r > 0) rlen += r;
+	}
+	ASSERT(substrn(resp, "101 Switching Protocols", rlen), "upgraded");
+
+	for (i = 0; i < 100; i++) off += ws_pipe_frame(frames + off, i % 20 + 1);
+	ws_pipe_write(fd, frames, off);
+	while (ALOAD(ws_pipe_count) != 100);
+
+	big = alloc(70000 + 14);
+	ASSERT(big, "big");
+	big_len = ws_pipe_frame(big, 70000);
+	ws_pipe_write(fd, big, 1000);
+	sleep(10);
+	ws_pipe_write(fd, big + 1000, big_len - 1000);
+	while (ALOAD(ws_pipe_count) != 101);
+	ASSERT_EQ(ALOAD(ws_pipe_bad), 0, "payloads intact");
+
+	close(fd);
+	while (!ALOAD(ws_pipe_closed));
+	release(big);
+	release(ws_pipe_count);
+	release(ws_pipe_bad);
+	release(ws_pipe_closed);
+	ASSERT(!ws_stop(ws), "ws_stop");
+	ws_destroy(ws);
+	ASSERT_BYTES(0);
+}
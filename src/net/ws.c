@@ -25,6 +25,7 @@
 
 #include <libfam/alloc.H>
 #include <libfam/atomic.H>
+#include <libfam/bytering.H>
 #include <libfam/connection.H>
 #include <libfam/error.H>
 #include <libfam/evh.H>
@@ -56,8 +57,8 @@ typedef struct {
 	Ws *ws;
 	Evh *evh;
 	RbTree connections;
-	Lock lock;
-} WsContext;
+	FairLock lock;
+} __attribute__((aligned(CACHE_LINE_SIZE))) WsContext;
 
 struct Ws {
 	WsContext *ctxs;
@@ -101,12 +102,10 @@ STATIC i32 ws_rbtree_search(RbTreeNode *cur, const RbTreeNode *value,
 	return 0;
 }
 
-STATIC i32 proc_message_single(Ws *ws, WsConnection *wsconn, u64 offset,
+STATIC i32 proc_message_single(Ws *ws, WsConnection *wsconn, u8 *payload,
 			       u64 len, u8 op, bool fin) {
 	WsMessage msg;
-	Vec *rbuf = connection_rbuf((Connection *)wsconn);
-	u8 *data = vec_data(rbuf);
-	msg.buffer = data + offset;
+	msg.buffer = payload;
 	msg.len = len;
 	msg.op = op;
 	msg.fin = fin;
@@ -115,18 +114,15 @@ STATIC i32 proc_message_single(Ws *ws, WsConnection *wsconn, u64 offset,
 }
 
 STATIC i32 ws_proc_handshake_client(WsConnection *wsconn) {
-	Vec *rbuf = connection_rbuf((Connection *)wsconn);
-	u64 rbuf_offset = vec_size(rbuf);
-	u8 *data = vec_data(rbuf);
+	ByteRing *rbuf = connection_rbuf((Connection *)wsconn);
+	u64 rbuf_offset = bytering_size(rbuf);
+	u8 *data = bytering_linearize(rbuf);
 	u8 *end;
 
 	if ((end = substrn(data, "\r\n\r\n", rbuf_offset))) {
 		u64 len = (u64)end - (u64)data;
 		if (substrn(data, "Upgrade: websocket", len)) {
-			if (len + 4 < rbuf_offset)
-				memorymove(data, (u8 *)((u64)data + len + 4),
-					   rbuf_offset - (len + 4));
-			vec_truncate(rbuf, rbuf_offset - (len + 4));
+			bytering_consume(rbuf, len + 4);
 			return 0;
 		} else {
 			err = EPROTO;
@@ -139,9 +135,9 @@ STATIC i32 ws_proc_handshake_client(WsConnection *wsconn) {
 }
 
 STATIC i32 ws_proc_handshake_server(WsConnection *wsconn) {
-	Vec *rbuf = connection_rbuf((Connection *)wsconn);
-	u64 rbuf_offset = vec_size(rbuf);
-	u8 *data = vec_data(rbuf);
+	ByteRing *rbuf = connection_rbuf((Connection *)wsconn);
+	u64 rbuf_offset = bytering_size(rbuf);
+	u8 *data = bytering_linearize(rbuf);
 	u8 *end;
 	u8 key[24];
 	SHA1_CTX sha1;
@@ -195,11 +191,7 @@ STATIC i32 ws_proc_handshake_server(WsConnection *wsconn) {
 				 strlen(SWITCHING_PROTOS));
 		connection_write((Connection *)wsconn, accept, strlen(accept));
 		connection_write((Connection *)wsconn, "\r\n\r\n", 4);
-		if (len + 4 < rbuf_offset) {
-			memorymove(data, (u8 *)((u64)data + len + 4),
-				   rbuf_offset - (len + 4));
-		}
-		vec_truncate(rbuf, rbuf_offset - (len + 4));
+		bytering_consume(rbuf, len + 4);
 
 		return 0;
 	} else {
@@ -209,9 +201,9 @@ STATIC i32 ws_proc_handshake_server(WsConnection *wsconn) {
 }
 
 STATIC i32 ws_proc_frames(Ws *ws, WsConnection *wsconn) {
-	Vec *rbuf = connection_rbuf((Connection *)wsconn);
-	u8 *data = vec_data(rbuf);
-	u64 rbuf_offset = vec_size(rbuf);
+	ByteRing *rbuf = connection_rbuf((Connection *)wsconn);
+	u64 rbuf_offset = bytering_size(rbuf);
+	u8 *data = bytering_linearize(rbuf);
 	bool fin, mask;
 	u8 op;
 	u64 len;
@@ -253,6 +245,11 @@ STATIC i32 ws_proc_frames(Ws *ws, WsConnection *wsconn) {
 		err = EPROTO;
 		return -1;
 	}
+	/* Unmask only once the whole frame has arrived */
+	if (data_start > rbuf_offset || len > rbuf_offset - data_start) {
+		err = EAGAIN;
+		return -1;
+	}
 	if (mask) {
 		u64 i;
 		u8 *payload;
@@ -267,17 +264,9 @@ STATIC i32 ws_proc_frames(Ws *ws, WsConnection *wsconn) {
 		}
 	}
 
-	if (data_start + len <= rbuf_offset) {
-		proc_message_single(ws, wsconn, data_start, len, op, fin);
-		if (len + data_start < rbuf_offset)
-			memorymove(data, (u8 *)((u64)data + len + data_start),
-				   rbuf_offset - (len + data_start));
-		vec_truncate(rbuf, rbuf_offset - (len + data_start));
-		return 0;
-	} else {
-		err = EAGAIN;
-		return -1;
-	}
+	proc_message_single(ws, wsconn, data + data_start, len, op, fin);
+	bytering_consume(rbuf, len + data_start);
+	return 0;
 }
 
 STATIC void ws_on_accept_proc(void *ctx, Connection *conn) {
@@ -288,7 +277,7 @@ STATIC void ws_on_accept_proc(void *ctx, Connection *conn) {
 	connection_set_flag(conn, CONN_FLAG_USR1, false);
 	connection_set_flag_upper_bits(conn, ws_ctx->id);
 	{
-		LockGuard lg = wlock(&ws_ctx->lock);
+		FairLockGuard lg = fair_wlock(&ws_ctx->lock);
 		rbtree_put(&ws_ctx->connections, (RbTreeNode *)wsconn,
 			   ws_rbtree_search);
 	}
@@ -304,7 +293,7 @@ STATIC void ws_on_connect_proc(void *ctx, Connection *conn, i32 error) {
 	connection_set_flag(conn, CONN_FLAG_USR1, false);
 	connection_set_flag_upper_bits(conn, ws_ctx->id);
 	{
-		LockGuard lg = wlock(&ws_ctx->lock);
+		FairLockGuard lg = fair_wlock(&ws_ctx->lock);
 		rbtree_put(&ws_ctx->connections, (RbTreeNode *)wsconn,
 			   ws_rbtree_search);
 	}
@@ -353,7 +342,7 @@ STATIC void ws_on_close_proc(void *ctx, Connection *conn) {
 
 	ws->config.on_close(ws, wsconn);
 	{
-		LockGuard lg = wlock(&ws_ctx->lock);
+		FairLockGuard lg = fair_wlock(&ws_ctx->lock);
 		rbtree_remove(&ws_ctx->connections, (RbTreeNode *)wsconn,
 			      ws_rbtree_search);
 	}
@@ -387,7 +376,8 @@ Ws *ws_init(const WsConfig *config) {
 
 	ret = alloc(sizeof(Ws));
 	if (ret == NULL) return NULL;
-	ret->ctxs = alloc(sizeof(WsContext) * workers);
+	/* One line per worker so their locks do not false share */
+	ret->ctxs = alloc_aligned(sizeof(WsContext) * workers, ALLOC_ISOLATED);
 	if (!ret->ctxs) {
 		release(ret);
 		return NULL;
@@ -406,7 +396,7 @@ Ws *ws_init(const WsConfig *config) {
 				    ws_on_connect_proc, ws_on_close_proc};
 		ret->ctxs[i].ws = ret;
 		ret->ctxs[i].id = i;
-		ret->ctxs[i].lock = LOCK_INIT;
+		fair_lock_init(&ret->ctxs[i].lock, NULL);
 		ret->ctxs[i].connections = RBTREE_INIT;
 		config.ctx = &ret->ctxs[i];
 		ret->ctxs[i].evh = evh_init(&config);
@@ -489,7 +479,7 @@ i32 ws_send(Ws *ws, WsConnection *conn, WsMessage *msg) {
 	}
 
 	{
-		LockGuard lg = wlock(&ws->ctxs[index].lock);
+		FairLockGuard lg = fair_wlock(&ws->ctxs[index].lock);
 		Connection *sres;
 		ws_rbtree_search(root, (RbTreeNode *)conn, &retval);
 		sres = (Connection *)retval.self;
@@ -543,7 +533,7 @@ i32 ws_close(Ws *ws, WsConnection *conn, i32 code, const u8 *reason) {
 	if (send_result < 0) return send_result;
 
 	{
-		LockGuard lg = wlock(&ws->ctxs[index].lock);
+		FairLockGuard lg = fair_wlock(&ws->ctxs[index].lock);
 		Connection *sres;
 		ws_rbtree_search(root, (RbTreeNode *)conn, &retval);
 		sres = (Connection *)retval.self;
@@ -0,0 +1,137 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/alloc.H>
+#include <libfam/arena.H>
+#include <libfam/error.H>
+#include <libfam/limits.H>
+#include <libfam/misc.H>
+
+struct ArenaBlock {
+	ArenaBlock *next;
+	u64 size;
+};
+
+#define ARENA_ALIGN(size) (((size) + 15) & ~15UL)
+#define BLOCK_DATA(block) ((u8 *)(block) + sizeof(ArenaBlock))
+
+/* Moves to the next spare block, dropping spares too small for size */
+STATIC void *arena_next_block(Arena *a, u64 size) {
+	ArenaBlock **link = a->cur ? &a->cur->next : &a->first;
+	ArenaBlock *block;
+	u64 need = size > a->block_size ? size : a->block_size;
+
+	while ((block = *link) && block->size < need) {
+		*link = block->next;
+		release(block);
+	}
+	if (!block) {
+		if (need > U64_MAX - sizeof(ArenaBlock)) {
+			err = ENOMEM;
+			return NULL;
+		}
+		if (!(block = alloc(sizeof(ArenaBlock) + need))) return NULL;
+		block->next = NULL;
+		block->size = need;
+		*link = block;
+	}
+
+	a->cur = block;
+	a->pos = BLOCK_DATA(block) + size;
+	a->end = BLOCK_DATA(block) + block->size;
+	return BLOCK_DATA(block);
+}
+
+PUBLIC i32 arena_init(Arena *a, u64 block_size) {
+	if (!a || !block_size) {
+		err = EINVAL;
+		return -1;
+	}
+	a->first = a->cur = NULL;
+	a->pos = a->end = NULL;
+	a->block_size = ARENA_ALIGN(block_size);
+	return 0;
+}
+
+PUBLIC void *arena_alloc(Arena *a, u64 size) {
+	void *ret;
+
+	if (!size || size > U64_MAX - 15) {
+		err = size ? ENOMEM : EINVAL;
+		return NULL;
+	}
+	size = ARENA_ALIGN(size);
+	if ((u64)(a->end - a->pos) < size) return arena_next_block(a, size);
+	ret = a->pos;
+	a->pos += size;
+	return ret;
+}
+
+PUBLIC void *arena_resize(Arena *a, void *ptr, u64 old_size, u64 new_size) {
+	u8 *ret;
+
+	if (!ptr) return arena_alloc(a, new_size);
+	if (!new_size || new_size > U64_MAX - 15) {
+		err = new_size ? ENOMEM : EINVAL;
+		return NULL;
+	}
+	old_size = ARENA_ALIGN(old_size);
+	if ((u8 *)ptr + old_size == a->pos &&
+	    (u64)(a->end - (u8 *)ptr) >= new_size) {
+		a->pos = (u8 *)ptr + ARENA_ALIGN(new_size);
+		return ptr;
+	}
+	if (!(ret = arena_alloc(a, new_size))) return NULL;
+	memcpy(ret, ptr, old_size < new_size ? old_size : new_size);
+	return ret;
+}
+
+PUBLIC ArenaMark arena_mark(Arena *a) {
+	ArenaMark ret;
+	ret.arena = a;
+	ret.block = a->cur;
+	ret.pos = a->pos;
+	return ret;
+}
+
+PUBLIC void arena_reset(ArenaMark *m) {
+	Arena *a = m->arena;
+	a->cur = m->block;
+	a->pos = m->pos;
+	a->end = m->block ? BLOCK_DATA(m->block) + m->block->size : NULL;
+}
+
+PUBLIC void arenaguard_cleanup(ArenaMark *m) { arena_reset(m); }
+
+PUBLIC void arena_destroy(Arena *a) {
+	ArenaBlock *block = a->first;
+	while (block) {
+		ArenaBlock *next = block->next;
+		release(block);
+		block = next;
+	}
+	a->first = a->cur = NULL;
+	a->pos = a->end = NULL;
+}
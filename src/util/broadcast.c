@@ -0,0 +1,331 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/atomic.H>
+#include <libfam/broadcast.H>
+#include <libfam/error.H>
+#include <libfam/limits.H>
+#include <libfam/misc.H>
+#include <libfam/spin.H>
+#include <libfam/sys.H>
+#include <libfam/syscall.H>
+#include <libfam/syscall_const.H>
+
+#define CACHE_LINE 64
+#define SUBSCRIBER_FREE 0
+#define SUBSCRIBER_CLAIMED 1
+#define SUBSCRIBER_ACTIVE 2
+
+/* One writer, so a slot's sequence is just pos + 1 once it holds pos and 0
+ * while it is being rewritten. Subscribers never write the ring: each owns
+ * a cursor line, which the publisher only scans under BROADCAST_BLOCK. */
+struct BroadcastInner {
+	u64 element_size;
+	u64 mask;
+	u64 stride;
+	u64 policy;
+	u64 max_subscribers;
+	u8 padding0[CACHE_LINE - 40];
+	u64 head; /* messages published */
+	u64 gate; /* slowest cursor last seen by the publisher */
+	u8 padding1[CACHE_LINE - 16];
+	u32 wait; /* futex word, bumped on publish while subscribers sleep */
+	u32 waiters;
+	u32 space; /* futex word, bumped on release while the publisher sleeps */
+	u32 space_waiters;
+	u8 padding2[CACHE_LINE - 16];
+};
+
+typedef struct {
+	u64 cursor;
+	u64 dropped;
+	u32 state;
+	u8 padding[CACHE_LINE - 20];
+} BroadcastSubscriber;
+
+#define SUB_AT(inner, id)                                         \
+	((BroadcastSubscriber *)((u8 *)(inner) + sizeof(BroadcastInner) + \
+				 (u64)(id) * sizeof(BroadcastSubscriber)))
+#define SLOT_AT(inner, pos)                                          \
+	((u64 *)((u8 *)(inner) + sizeof(BroadcastInner) +            \
+		 (inner)->max_subscribers * sizeof(BroadcastSubscriber) + \
+		 ((pos) & (inner)->mask) * (inner)->stride))
+#define SLOT_DATA(slot) ((u8 *)(slot) + sizeof(u64))
+
+STATIC u64 broadcast_mapped_size(BroadcastInner *inner) {
+	return sizeof(BroadcastInner) +
+	       inner->max_subscribers * sizeof(BroadcastSubscriber) +
+	       (inner->mask + 1) * inner->stride;
+}
+
+/* Sleeps until word moves on from the value read. deadline is in micros,
+ * 0 for none. */
+STATIC i32 broadcast_sleep(u32 *word, u32 value, i64 deadline) {
+	struct timespec ts;
+	i64 left;
+
+	if (deadline) {
+		if ((left = deadline - micros()) <= 0) {
+			err = ETIMEDOUT;
+			return -1;
+		}
+		ts.tv_sec = left / 1000000;
+		ts.tv_nsec = (left % 1000000) * 1000;
+	}
+	futex(word, FUTEX_WAIT, value, deadline ? &ts : NULL, NULL, 0);
+	return 0;
+}
+
+/* The publisher's head store must be visible before the states are read,
+ * pairing with the fence in broadcast_subscribe. */
+STATIC u64 slowest_cursor(BroadcastInner *inner, u64 head) {
+	BroadcastSubscriber *sub;
+	u64 min = head, i, cursor;
+
+	AFENCE();
+	for (i = 0; i < inner->max_subscribers; i++) {
+		sub = SUB_AT(inner, i);
+		if (ALOAD(&sub->state) != SUBSCRIBER_ACTIVE) continue;
+		cursor = ALOAD(&sub->cursor);
+		if ((i64)(cursor - min) < 0) min = cursor;
+	}
+	return min;
+}
+
+STATIC void broadcast_notify_space(BroadcastInner *inner) {
+	if (inner->policy != BROADCAST_BLOCK) return;
+	AFENCE();
+	if (!ALOAD(&inner->space_waiters)) return;
+	__add32(&inner->space, 1);
+	futex(&inner->space, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void broadcast_destroy(Broadcast *b) {
+	if (b && b->inner) {
+		munmap(b->inner, broadcast_mapped_size(b->inner));
+		b->inner = NULL;
+	}
+}
+
+Broadcast broadcast(u64 element_size, u64 capacity, u32 max_subscribers,
+		    BroadcastPolicy policy) {
+	Broadcast ret = {0};
+	u64 slots = 1, stride, fixed, i;
+
+	if (!capacity || !element_size || !max_subscribers ||
+	    capacity > (1UL << 40) || element_size > (1UL << 40) ||
+	    (policy != BROADCAST_DROP && policy != BROADCAST_BLOCK)) {
+		err = EINVAL;
+		return ret;
+	}
+	while (slots < capacity) slots <<= 1;
+	stride = sizeof(u64) + ((element_size + 7) & ~7UL);
+	fixed = sizeof(BroadcastInner) +
+		(u64)max_subscribers * sizeof(BroadcastSubscriber);
+	if (stride > (U64_MAX - fixed) / slots) {
+		err = EINVAL;
+		return ret;
+	}
+	ret.inner = smap(fixed + slots * stride);
+	if (ret.inner == NULL) return ret;
+	ret.inner->element_size = element_size;
+	ret.inner->mask = slots - 1;
+	ret.inner->stride = stride;
+	ret.inner->policy = policy;
+	ret.inner->max_subscribers = max_subscribers;
+	ret.inner->head = ret.inner->gate = 0;
+	ret.inner->wait = ret.inner->waiters = 0;
+	ret.inner->space = ret.inner->space_waiters = 0;
+	for (i = 0; i < max_subscribers; i++) {
+		SUB_AT(ret.inner, i)->cursor = SUB_AT(ret.inner, i)->dropped = 0;
+		SUB_AT(ret.inner, i)->state = SUBSCRIBER_FREE;
+	}
+	for (i = 0; i < slots; i++) *SLOT_AT(ret.inner, i) = 0;
+	return ret;
+}
+
+bool broadcast_ok(Broadcast *b) { return b && b->inner != NULL; }
+
+i32 broadcast_subscribe(Broadcast *b) {
+	BroadcastInner *inner = b->inner;
+	BroadcastSubscriber *sub;
+	u32 state;
+	u64 i;
+
+	for (i = 0; i < inner->max_subscribers; i++) {
+		sub = SUB_AT(inner, i);
+		state = SUBSCRIBER_FREE;
+		if (!__cas32(&sub->state, &state, SUBSCRIBER_CLAIMED)) continue;
+		sub->dropped = 0;
+		ASTORE(&sub->cursor, ALOAD(&inner->head));
+		ASTORE(&sub->state, SUBSCRIBER_ACTIVE);
+		/* A publisher that missed the claim may have moved on, so start
+		 * from a head it published after seeing it */
+		AFENCE();
+		ASTORE(&sub->cursor, ALOAD(&inner->head));
+		return i;
+	}
+	err = ENOSPC;
+	return -1;
+}
+
+void broadcast_unsubscribe(Broadcast *b, i32 id) {
+	ASTORE(&SUB_AT(b->inner, id)->state, SUBSCRIBER_FREE);
+	broadcast_notify_space(b->inner);
+}
+
+i32 broadcast_publish(Broadcast *b, const void *src, i64 timeout_ms) {
+	BroadcastInner *inner = b->inner;
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	u64 pos = inner->head, *slot;
+	i64 deadline = 0;
+	u32 space;
+
+	if (inner->policy == BROADCAST_BLOCK && pos - inner->gate > inner->mask)
+		inner->gate = slowest_cursor(inner, pos);
+	if (timeout_ms > 0) deadline = micros() + timeout_ms * 1000;
+	while (inner->policy == BROADCAST_BLOCK &&
+	       pos - inner->gate > inner->mask) {
+		if (!timeout_ms) {
+			err = EOVERFLOW;
+			return -1;
+		}
+		if (!spin_wait(&sw)) {
+			__add32(&inner->space_waiters, 1);
+			space = ALOAD(&inner->space);
+			inner->gate = slowest_cursor(inner, pos);
+			if (pos - inner->gate > inner->mask &&
+			    broadcast_sleep(&inner->space, space, deadline) <
+				0) {
+				__sub32(&inner->space_waiters, 1);
+				return -1;
+			}
+			__sub32(&inner->space_waiters, 1);
+		}
+		inner->gate = slowest_cursor(inner, pos);
+	}
+
+	slot = SLOT_AT(inner, pos);
+	if (inner->policy == BROADCAST_DROP) {
+		/* Lapped readers must see the slot change under them */
+		ASTORE(slot, 0);
+		AFENCE();
+	}
+	memcpy(SLOT_DATA(slot), src, inner->element_size);
+	ASTORE(slot, pos + 1);
+	ASTORE(&inner->head, pos + 1);
+	AFENCE();
+	if (ALOAD(&inner->waiters)) {
+		__add32(&inner->wait, 1);
+		futex(&inner->wait, FUTEX_WAKE, I32_MAX, NULL, NULL, 0);
+	}
+	return 0;
+}
+
+STATIC const void *broadcast_peek_now(BroadcastInner *inner,
+				      BroadcastSubscriber *sub) {
+	u64 cursor = sub->cursor, head, *slot;
+
+	while ((head = ALOAD(&inner->head)) != cursor) {
+		if (head - cursor > inner->mask + 1) {
+			sub->dropped += head - cursor - (inner->mask + 1);
+			cursor = head - (inner->mask + 1);
+		}
+		slot = SLOT_AT(inner, cursor);
+		if (ALOAD(slot) == cursor + 1) {
+			ASTORE(&sub->cursor, cursor);
+			return SLOT_DATA(slot);
+		}
+		/* Being rewritten a lap ahead */
+		sub->dropped++;
+		cursor++;
+	}
+	ASTORE(&sub->cursor, cursor);
+	err = EAGAIN;
+	return NULL;
+}
+
+const void *broadcast_peek(Broadcast *b, i32 id, i64 timeout_ms) {
+	BroadcastInner *inner = b->inner;
+	BroadcastSubscriber *sub = SUB_AT(inner, id);
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	const void *data;
+	i64 deadline = 0;
+	u32 wait;
+
+	if ((data = broadcast_peek_now(inner, sub))) return data;
+	if (!timeout_ms) return NULL;
+	if (timeout_ms > 0) deadline = micros() + timeout_ms * 1000;
+
+	while (spin_wait(&sw))
+		if ((data = broadcast_peek_now(inner, sub))) return data;
+	while (true) {
+		__add32(&inner->waiters, 1);
+		wait = ALOAD(&inner->wait);
+		if ((data = broadcast_peek_now(inner, sub))) {
+			__sub32(&inner->waiters, 1);
+			return data;
+		}
+		if (broadcast_sleep(&inner->wait, wait, deadline) < 0) {
+			__sub32(&inner->waiters, 1);
+			return NULL;
+		}
+		__sub32(&inner->waiters, 1);
+	}
+}
+
+i32 broadcast_release(Broadcast *b, i32 id) {
+	BroadcastInner *inner = b->inner;
+	BroadcastSubscriber *sub = SUB_AT(inner, id);
+	u64 cursor = sub->cursor;
+	bool intact = true;
+
+	if (inner->policy == BROADCAST_DROP) {
+		/* Reads of the data must complete before the recheck */
+		AFENCE();
+		intact = ALOAD(SLOT_AT(inner, cursor)) == cursor + 1;
+	}
+	ASTORE(&sub->cursor, cursor + 1);
+	broadcast_notify_space(inner);
+	if (!intact) {
+		sub->dropped++;
+		err = EOVERFLOW;
+		return -1;
+	}
+	return 0;
+}
+
+i32 broadcast_recv(Broadcast *b, i32 id, void *dst, i64 timeout_ms) {
+	const void *data;
+	while ((data = broadcast_peek(b, id, timeout_ms))) {
+		memcpy(dst, data, b->inner->element_size);
+		if (!broadcast_release(b, id)) return 0;
+	}
+	return -1;
+}
+
+u64 broadcast_dropped(Broadcast *b, i32 id) {
+	return ALOAD(&SUB_AT(b->inner, id)->dropped);
+}
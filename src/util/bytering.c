@@ -0,0 +1,208 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/alloc.H>
+#include <libfam/bytering.H>
+#include <libfam/error.H>
+#include <libfam/misc.H>
+#include <libfam/sys.H>
+
+#define BYTERING_MAX_CAPACITY ((u64)1 << 62)
+
+struct ByteRing {
+	u64 head;
+	u64 tail;
+	u64 mask;
+	u32 flags;
+	u8 *data;
+};
+
+STATIC u64 bytering_round_capacity(u64 capacity, u32 flags) {
+	u64 min = flags & BYTERING_MIRROR ? PAGE_SIZE : BYTERING_MIN_CAPACITY;
+	if (capacity <= min) return min;
+	return (u64)1 << (64 - __builtin_clzll(capacity - 1));
+}
+
+ByteRing *bytering_new(u64 capacity, u32 flags) {
+	ByteRing *r;
+	if (capacity > BYTERING_MAX_CAPACITY || flags & ~BYTERING_MIRROR) {
+		err = EINVAL;
+		return NULL;
+	}
+	capacity = bytering_round_capacity(capacity, flags);
+	if (flags & BYTERING_MIRROR) {
+		if (!(r = alloc(sizeof(ByteRing)))) return NULL;
+		if (!(r->data = mirror_map(capacity))) {
+			release(r);
+			return NULL;
+		}
+	} else {
+		if (!(r = alloc(sizeof(ByteRing) + capacity))) return NULL;
+		r->data = (u8 *)r + sizeof(ByteRing);
+	}
+	r->head = r->tail = 0;
+	r->mask = capacity - 1;
+	r->flags = flags;
+	return r;
+}
+
+void bytering_release(ByteRing *r) {
+	if (!r) return;
+	if (r->flags & BYTERING_MIRROR) munmap(r->data, (r->mask + 1) << 1);
+	release(r);
+}
+
+u64 bytering_capacity(const ByteRing *r) { return r ? r->mask + 1 : 0; }
+
+u64 bytering_size(const ByteRing *r) { return r ? r->tail - r->head : 0; }
+
+u64 bytering_space(const ByteRing *r) {
+	return r ? r->mask + 1 - (r->tail - r->head) : 0;
+}
+
+u8 *bytering_readable(ByteRing *r, u64 *len) {
+	u64 off, size;
+	if (!r) {
+		*len = 0;
+		return NULL;
+	}
+	off = r->head & r->mask;
+	size = r->tail - r->head;
+	if (!(r->flags & BYTERING_MIRROR) && off + size > r->mask + 1)
+		size = r->mask + 1 - off;
+	*len = size;
+	return r->data + off;
+}
+
+u8 *bytering_writable(ByteRing *r, u64 *len) {
+	u64 off, space;
+	if (!r) {
+		*len = 0;
+		return NULL;
+	}
+	off = r->tail & r->mask;
+	space = r->mask + 1 - (r->tail - r->head);
+	if (!(r->flags & BYTERING_MIRROR) && off + space > r->mask + 1)
+		space = r->mask + 1 - off;
+	*len = space;
+	return r->data + off;
+}
+
+i32 bytering_consume(ByteRing *r, u64 len) {
+	if (len > bytering_size(r)) {
+		err = EINVAL;
+		return -1;
+	}
+	if (!r) return 0;
+	r->head += len;
+	/* Restart an empty ring at the start of its storage */
+	if (r->head == r->tail) r->head = r->tail = 0;
+	return 0;
+}
+
+i32 bytering_commit(ByteRing *r, u64 len) {
+	if (len > bytering_space(r)) {
+		err = EINVAL;
+		return -1;
+	}
+	if (r) r->tail += len;
+	return 0;
+}
+
+i32 bytering_write(ByteRing *r, const void *data, u64 len) {
+	u64 span;
+	u8 *dst;
+	if (len > bytering_space(r)) {
+		err = ENOBUFS;
+		return -1;
+	}
+	if (!len) return 0;
+	dst = bytering_writable(r, &span);
+	if (span >= len)
+		memcpy(dst, data, len);
+	else {
+		memcpy(dst, data, span);
+		memcpy(r->data, (const u8 *)data + span, len - span);
+	}
+	r->tail += len;
+	return 0;
+}
+
+STATIC void bytering_reverse(u8 *p, u64 len) {
+	u8 *q = p + len;
+	while (p + 1 < q) {
+		u8 tmp = *p;
+		*p++ = *--q;
+		*q = tmp;
+	}
+}
+
+u8 *bytering_linearize(ByteRing *r) {
+	u64 capacity, off, size, first;
+	if (!r) return NULL;
+	capacity = r->mask + 1;
+	off = r->head & r->mask;
+	size = r->tail - r->head;
+	if (r->flags & BYTERING_MIRROR || off + size <= capacity)
+		return r->data + off;
+
+	first = capacity - off;
+	if (first <= capacity - size) {
+		/* The gap can hold the tail end: slide the wrapped part up */
+		memorymove(r->data + first, r->data, size - first);
+		memcpy(r->data, r->data + off, first);
+	} else {
+		/* Rotate the whole storage left by off */
+		bytering_reverse(r->data, off);
+		bytering_reverse(r->data + off, first);
+		bytering_reverse(r->data, capacity);
+	}
+	r->head = 0;
+	r->tail = size;
+	return r->data;
+}
+
+ByteRing *bytering_reserve(ByteRing *r, u64 additional) {
+	u64 size = bytering_size(r), capacity = bytering_capacity(r), span;
+	u32 flags = r ? r->flags : 0;
+	ByteRing *ret;
+	u8 *src;
+
+	if (additional > BYTERING_MAX_CAPACITY - size) {
+		err = EOVERFLOW;
+		return NULL;
+	}
+	if (r && capacity - size >= additional) return r;
+	if (capacity << 1 > size + additional) additional = (capacity << 1) - size;
+	if (!(ret = bytering_new(size + additional, flags))) return NULL;
+	if (r) {
+		src = bytering_readable(r, &span);
+		memcpy(ret->data, src, span);
+		memcpy(ret->data + span, r->data, size - span);
+		ret->tail = size;
+		bytering_release(r);
+	}
+	return ret;
+}
@@ -27,43 +27,224 @@
 #include <libfam/atomic.H>
 #include <libfam/channel.H>
 #include <libfam/error.H>
+#include <libfam/limits.H>
+#include <libfam/lock.H>
 #include <libfam/misc.H>
+#include <libfam/spin.H>
+#include <libfam/sys.H>
 #include <libfam/syscall.H>
 #include <libfam/syscall_const.H>
 
+/* Defines the function behind the LOCKPROF macro */
+#undef recv
+
 #define DEFAULT_CAPACITY 1024
+#define CACHE_LINE 64
+#define UNBOUNDED 0x1
+/* Set in a segment's head once its successor is linked, senders move on */
+#define SEALED (1UL << 63)
 
+/* Vyukov style bounded MPMC ring. Every slot carries a sequence number:
+ * pos means free for the sender claiming pos, pos + 1 means it holds the
+ * message for the receiver claiming pos. Senders and receivers only CAS
+ * their own counter and then own the slot until they publish its sequence,
+ * so nobody can see a half written element. head, tail and the wait words
+ * each get their own cache line.
+ *
+ * An unbounded channel is a list of such rings (segments) taken from the
+ * shared allocator. The first one is the root and holds the wait words and
+ * the list. A full segment is sealed after a fresh one is linked behind it,
+ * and a drained one is retired and reused once its last peek is released.
+ * Segments are only given back in channel_destroy, since a process may
+ * still be looking at a retired one. */
 struct ChannelInner {
 	u64 element_size;
 	u64 capacity;
+	u64 mask;
+	u64 stride;
+	u64 flags;
+	ChannelInner *next;	   /* following segment */
+	ChannelInner *retired_next; /* retired list, under lock */
+	ChannelInner *all_next;	   /* every segment, for destroy */
 	u64 head;
+	u8 padding1[CACHE_LINE - 8];
 	u64 tail;
-	u32 wait;
-	u8 padding[12];
+	u8 padding2[CACHE_LINE - 8];
+	u32 wait; /* futex word, bumped when a sleeper must recheck */
+	u32 waiters;
+	i32 efd;   /* eventfd for event loops, -1 when unused */
+	u32 armed; /* efd wants a write on the next publish */
+	u32 space; /* futex word for send_wait, bumped when slots free up */
+	u32 space_waiters;
+	u8 padding3[CACHE_LINE - 24];
+	ChannelInner *send_seg;
+	ChannelInner *recv_seg;
+	ChannelInner *retired;
+	Lock lock;
+	u8 padding4[CACHE_LINE - 28];
 };
 
-#define ELEMENT_AT(channel, i)                              \
-	((u8 *)channel->inner + sizeof(ChannelInner) + \
-	 i * channel->inner->element_size)
+#define SLOT_AT(inner, pos)                              \
+	((u64 *)((u8 *)(inner) + sizeof(ChannelInner) + \
+		 ((pos) & (inner)->mask) * (inner)->stride))
+#define SLOT_DATA(slot) ((u8 *)(slot) + sizeof(u64))
+#define IS_UNBOUNDED(inner) ((inner)->flags & UNBOUNDED)
+
+STATIC u64 channel_mapped_size(ChannelInner *inner) {
+	return sizeof(ChannelInner) + (inner->mask + 1) * inner->stride;
+}
+
+STATIC void segment_init(ChannelInner *seg) {
+	u64 i;
+	seg->next = NULL;
+	seg->tail = 0;
+	for (i = 0; i <= seg->mask; i++) *SLOT_AT(seg, i) = i;
+}
+
+STATIC ChannelInner *send_segment(ChannelInner *inner) {
+	return IS_UNBOUNDED(inner) ? ALOAD(&inner->send_seg) : inner;
+}
+
+STATIC ChannelInner *recv_segment(ChannelInner *inner) {
+	return IS_UNBOUNDED(inner) ? ALOAD(&inner->recv_seg) : inner;
+}
 
-#define NEXT_POS(channel, pos) ((pos + 1) % channel->inner->capacity)
+/* Every slot of the last lap is released: free slots hold the position of
+ * the next lap, which is at least head. */
+STATIC bool segment_drained(ChannelInner *seg) {
+	u64 head = ALOAD(&seg->head) & ~SEALED, i;
+	if (ALOAD(&seg->tail) != head) return false;
+	for (i = 0; i <= seg->mask; i++)
+		if ((i64)(ALOAD(SLOT_AT(seg, i)) - head) < 0) return false;
+	return true;
+}
+
+/* Links a fresh segment behind the full seg unless another sender already
+ * did. Returns -1 (ENOMEM) if none can be had. */
+STATIC i32 channel_grow(ChannelInner *inner, ChannelInner *seg) {
+	LockGuard lg = wlock(&inner->lock);
+	ChannelInner *next, **prev;
+	u64 head;
 
-STATIC i32 notify(Channel *channel, u64 num_messages) {
-	u32 exp = 1;
-	if (__cas32(&channel->inner->wait, &exp, 0))
-		return futex(&channel->inner->wait, FUTEX_WAKE, num_messages,
-			     NULL, NULL, 0) >= 0
-			   ? 0
-			   : -1;
+	if (ALOAD(&inner->send_seg) != seg) return 0;
+	for (prev = &inner->retired; (next = *prev); prev = &next->retired_next)
+		if (segment_drained(next)) break;
+	if (next) {
+		/* Drained, so every slot already waits for the lap at head.
+		 * Positions keep counting up so stale claims cannot match. */
+		*prev = next->retired_next;
+		next->next = NULL;
+		head = ALOAD(&next->head) & ~SEALED;
+	} else {
+		next = alloc_aligned(channel_mapped_size(inner), CACHE_LINE);
+		if (!next) return -1;
+		memcpy(next, inner, sizeof(u64) * 5);
+		next->all_next = inner->all_next;
+		inner->all_next = next;
+		segment_init(next);
+		head = 0;
+	}
+	ASTORE(&next->head, head);
+	ASTORE(&seg->next, next);
+	head = ALOAD(&seg->head);
+	while (!__cas64(&seg->head, &head, head | SEALED));
+	ASTORE(&inner->send_seg, next);
+	return 0;
+}
+
+/* Moves receivers past seg when it is sealed and empty. Returns whether
+ * they should look again. */
+STATIC bool channel_advance(ChannelInner *inner, ChannelInner *seg) {
+	ChannelInner *next;
+	u64 head;
+
+	if (!IS_UNBOUNDED(inner)) return false;
+	head = ALOAD(&seg->head);
+	if (!(head & SEALED) || (head & ~SEALED) != ALOAD(&seg->tail))
+		return false;
+	next = ALOAD(&seg->next);
+	if (__cas64((u64 *)&inner->recv_seg, (u64 *)&seg, (u64)next)) {
+		LockGuard lg = wlock(&inner->lock);
+		seg->retired_next = inner->retired;
+		inner->retired = seg;
+	}
+	return true;
+}
+
+STATIC bool segment_pending(ChannelInner *seg) {
+	u64 pos = ALOAD(&seg->tail);
+	return ALOAD(SLOT_AT(seg, pos)) == pos + 1;
+}
+
+STATIC bool channel_pending(ChannelInner *inner) {
+	ChannelInner *seg;
+	do {
+		seg = recv_segment(inner);
+		if (segment_pending(seg)) return true;
+	} while (channel_advance(inner, seg));
+	return false;
+}
+
+STATIC void signal_event(ChannelInner *inner) {
+	u32 armed = 1;
+	u64 v = 1;
+	if (__cas32(&inner->armed, &armed, 0)) write(inner->efd, &v, sizeof(v));
+}
+
+/* One wake for up to num_messages sleepers */
+STATIC i32 notify(ChannelInner *inner, u64 num_messages) {
+	u32 waiters;
+	/* The published sequence must be visible before waiters is read */
+	AFENCE();
+	if (ALOAD(&inner->armed)) signal_event(inner);
+	if (!(waiters = ALOAD(&inner->waiters))) return 0;
+	if (num_messages > waiters) num_messages = waiters;
+	__add32(&inner->wait, 1);
+	return futex(&inner->wait, FUTEX_WAKE, num_messages, NULL, NULL, 0) >=
+			   0
+		   ? 0
+		   : -1;
+}
+
+/* As notify, for senders blocked in send_wait once num_slots are freed */
+STATIC void notify_space(ChannelInner *inner, u64 num_slots) {
+	u32 waiters;
+	if (IS_UNBOUNDED(inner)) return;
+	AFENCE();
+	if (!(waiters = ALOAD(&inner->space_waiters))) return;
+	if (num_slots > waiters) num_slots = waiters;
+	__add32(&inner->space, 1);
+	futex(&inner->space, FUTEX_WAKE, num_slots, NULL, NULL, 0);
+}
+
+/* Sleeps until word moves on from the value read. deadline is in micros,
+ * 0 for none. */
+STATIC i32 channel_sleep(u32 *word, u32 value, i64 deadline) {
+	struct timespec ts;
+	i64 left;
+
+	if (deadline) {
+		if ((left = deadline - micros()) <= 0) {
+			err = ETIMEDOUT;
+			return -1;
+		}
+		ts.tv_sec = left / 1000000;
+		ts.tv_nsec = (left % 1000000) * 1000;
+	}
+	/* EAGAIN, EINTR and timeouts all just mean recheck */
+	futex(word, FUTEX_WAIT, value, deadline ? &ts : NULL, NULL, 0);
 	return 0;
 }
 
 void channel_destroy(Channel *channel) {
+	ChannelInner *seg, *next;
 	if (channel && channel->inner) {
-		u64 size =
-		    sizeof(ChannelInner) +
-		    channel->inner->element_size * channel->inner->capacity;
-		munmap(channel->inner, size);
+		if (channel->inner->efd >= 0) close(channel->inner->efd);
+		for (seg = channel->inner->all_next; seg; seg = next) {
+			next = seg->all_next;
+			release(seg);
+		}
+		munmap(channel->inner, channel_mapped_size(channel->inner));
 		channel->inner = NULL;
 	}
 }
@@ -72,76 +253,420 @@ Channel channel(u64 element_size) {
 }
 Channel channel2(u64 element_size, u64 capacity) {
 	Channel ret = {0};
-	if (capacity == 0 || element_size == 0) {
+	u64 slots = 1, stride;
+	if (capacity == 0 || element_size == 0 || capacity > (1UL << 40) ||
+	    element_size > (1UL << 40)) {
 		err = EINVAL;
 		return ret;
 	}
-	capacity++;
-	ret.inner = smap(sizeof(ChannelInner) + element_size * capacity);
+	while (slots < capacity) slots <<= 1;
+	stride = sizeof(u64) + ((element_size + 7) & ~7UL);
+	if (stride > (U64_MAX - sizeof(ChannelInner)) / slots) {
+		err = EINVAL;
+		return ret;
+	}
+	ret.inner = smap(sizeof(ChannelInner) + slots * stride);
 	if (ret.inner == NULL) return ret;
 	ret.inner->element_size = element_size;
 	ret.inner->capacity = capacity;
-	ret.inner->wait = 0;
-	ret.inner->head = ret.inner->tail = 0;
+	ret.inner->mask = slots - 1;
+	ret.inner->stride = stride;
+	ret.inner->flags = 0;
+	ret.inner->retired_next = ret.inner->all_next = NULL;
+	ret.inner->wait = ret.inner->waiters = ret.inner->armed = 0;
+	ret.inner->space = ret.inner->space_waiters = 0;
+	ret.inner->efd = -1;
+	ret.inner->send_seg = ret.inner->recv_seg = ret.inner;
+	ret.inner->retired = NULL;
+	ret.inner->lock = LOCK_INIT;
+	ret.inner->head = 0;
+	segment_init(ret.inner);
+	return ret;
+}
+Channel channel_unbounded(u64 element_size, u64 segment_capacity) {
+	Channel ret;
+	u64 slots = 1;
+	if (!segment_capacity) segment_capacity = DEFAULT_CAPACITY;
+	/* Segments are always full rings, only the channel has no limit */
+	while (slots < segment_capacity) slots <<= 1;
+	ret = channel2(element_size, slots);
+	if (!ret.inner) return ret;
+	/* Larger segments would be mapped privately by their sender */
+	if (channel_mapped_size(ret.inner) > MAX_MULTI_CHUNK_SIZE) {
+		channel_destroy(&ret);
+		err = EINVAL;
+		return ret;
+	}
+	ret.inner->flags |= UNBOUNDED;
 	return ret;
 }
 bool channel_ok(Channel *channel) { return channel && channel->inner != NULL; }
 
 void recv(Channel *channel, void *dst) {
-	u64 tail, head, num_messages;
+	ChannelInner *inner = channel->inner;
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	u32 wait;
 
 	while (recv_now(channel, dst) == -1) {
-		ASTORE(&channel->inner->wait, 1);
-		if (recv_now(channel, dst) == 0) break;
-		futex(&channel->inner->wait, FUTEX_WAIT, 1, NULL, NULL, 0);
+		if (spin_wait(&sw)) continue;
+		__add32(&inner->waiters, 1);
+		wait = ALOAD(&inner->wait);
+		if (recv_now(channel, dst) == 0) {
+			__sub32(&inner->waiters, 1);
+			break;
+		}
+		channel_sleep(&inner->wait, wait, 0);
+		__sub32(&inner->waiters, 1);
 	}
+}
+
+#if LOCKPROF == 1
+void recv_at(Channel *channel, void *dst, const u8 *file, u32 line) {
+	u64 start = cpu_ticks();
+	bool empty = recv_now(channel, dst) < 0;
+	if (empty) recv(channel, dst);
+	lockprof_wait(lockprof_site(file, line, LOCKPROF_RECV),
+		      cpu_ticks() - start, empty);
+}
+#endif /* LOCKPROF */
 
-	tail = ALOAD(&channel->inner->tail);
-	head = ALOAD(&channel->inner->head);
-	if (tail != head) {
-		num_messages = (tail >= head)
-				   ? (tail - head)
-				   : (tail - head + channel->inner->capacity);
-		if (num_messages)
-			futex(&channel->inner->wait, FUTEX_WAKE, num_messages,
-			      NULL, NULL, 0);
+/* A receiver that lagged may hold a segment that was retired and relinked
+ * behind newer ones since. Checked once a ready slot is seen: seg cannot
+ * be retired again before that slot is taken, so the claim that follows
+ * either is in order or fails. */
+STATIC bool segment_stale(ChannelInner *inner, ChannelInner *seg) {
+	return seg != recv_segment(inner);
+}
+
+STATIC void *segment_peek(ChannelInner *inner, ChannelInner *seg) {
+	u64 pos = ALOAD(&seg->tail), seq, *slot;
+
+	while (true) {
+		slot = SLOT_AT(seg, pos);
+		seq = ALOAD(slot);
+		if (seq == pos + 1) {
+			if (segment_stale(inner, seg)) {
+				err = EAGAIN;
+				return NULL;
+			}
+			if (__cas64(&seg->tail, &pos, pos + 1)) break;
+		} else if ((i64)(seq - (pos + 1)) < 0) {
+			err = EAGAIN;
+			return NULL;
+		} else
+			pos = ALOAD(&seg->tail);
 	}
+	return SLOT_DATA(slot);
 }
 
-i32 recv_now(Channel *channel, void *dst) {
-	u64 tail, head;
+void *channel_peek(Channel *channel) {
+	ChannelInner *seg;
+	void *data;
 	do {
-		tail = ALOAD(&channel->inner->tail);
-		head = ALOAD(&channel->inner->head);
-		if (tail == head) {
-			err = EAGAIN;
+		seg = recv_segment(channel->inner);
+		if ((data = segment_peek(channel->inner, seg))) return data;
+	} while (channel_advance(channel->inner, seg) ||
+		 segment_stale(channel->inner, seg));
+	return NULL;
+}
+
+void channel_release(Channel *channel, void *data) {
+	u64 *slot = (u64 *)data - 1;
+	/* Free for the sender one lap ahead */
+	ASTORE(slot, ALOAD(slot) + channel->inner->mask);
+	notify_space(channel->inner, 1);
+}
+
+i32 recv_now(Channel *channel, void *dst) {
+	void *data = channel_peek(channel);
+	if (!data) return -1;
+	memcpy(dst, data, channel->inner->element_size);
+	channel_release(channel, data);
+	return 0;
+}
+
+STATIC void *segment_reserve(ChannelInner *seg) {
+	u64 pos = ALOAD(&seg->head), seq, *slot;
+
+	while (true) {
+		if (pos & SEALED) {
+			err = EOVERFLOW;
+			return NULL;
+		}
+		slot = SLOT_AT(seg, pos);
+		seq = ALOAD(slot);
+		if (seq == pos) {
+			/* The ring may be larger than the requested capacity */
+			if ((i64)(pos - ALOAD(&seg->tail)) >=
+			    (i64)seg->capacity) {
+				err = EOVERFLOW;
+				return NULL;
+			}
+			if (__cas64(&seg->head, &pos, pos + 1)) break;
+		} else if ((i64)(seq - pos) < 0) {
+			err = EOVERFLOW;
+			return NULL;
+		} else
+			pos = ALOAD(&seg->head);
+	}
+	return SLOT_DATA(slot);
+}
+
+void *channel_reserve(Channel *channel) {
+	ChannelInner *inner = channel->inner, *seg;
+	void *data;
+
+	while (true) {
+		seg = send_segment(inner);
+		if ((data = segment_reserve(seg)) || !IS_UNBOUNDED(inner))
+			return data;
+		if (channel_grow(inner, seg) < 0) return NULL;
+	}
+}
+
+i32 channel_commit(Channel *channel, void *data) {
+	u64 *slot = (u64 *)data - 1;
+	/* A reserved slot still holds its own position */
+	ASTORE(slot, ALOAD(slot) + 1);
+	return notify(channel->inner, 1);
+}
+
+i32 send(Channel *channel, const void *src) {
+	void *data = channel_reserve(channel);
+	if (!data) return -1;
+	memcpy(data, src, channel->inner->element_size);
+	return channel_commit(channel, data);
+}
+
+i32 send_wait(Channel *channel, const void *src, i64 timeout_ms) {
+	ChannelInner *inner = channel->inner;
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	i64 deadline = 0;
+	u32 space;
+
+	if (timeout_ms > 0) deadline = micros() + timeout_ms * 1000;
+	while (send(channel, src) < 0) {
+		if (err != EOVERFLOW || !timeout_ms) return -1;
+		if (spin_wait(&sw)) continue;
+		__add32(&inner->space_waiters, 1);
+		space = ALOAD(&inner->space);
+		if (send(channel, src) == 0) {
+			__sub32(&inner->space_waiters, 1);
+			break;
+		}
+		if (err != EOVERFLOW ||
+		    channel_sleep(&inner->space, space, deadline) < 0) {
+			__sub32(&inner->space_waiters, 1);
 			return -1;
 		}
-		memcpy(dst, ELEMENT_AT(channel, tail),
-		       channel->inner->element_size);
-	} while (
-	    !__cas64(&channel->inner->tail, &tail, NEXT_POS(channel, tail)));
+		__sub32(&inner->space_waiters, 1);
+	}
 	return 0;
 }
 
-i32 send(Channel *channel, const void *src) {
-	u64 tail, head, num_messages;
-	do {
-		head = ALOAD(&channel->inner->head);
-		tail = ALOAD(&channel->inner->tail);
-		if ((head + 1) % channel->inner->capacity == tail) {
+/* Claims and fills up to n slots of seg with one CAS. Returns the number
+ * sent, 0 (EOVERFLOW) when seg is full. */
+STATIC u64 segment_send_batch(ChannelInner *seg, const void *src, u64 n) {
+	u64 pos = ALOAD(&seg->head), used, room, k, i;
+
+	while (true) {
+		if (pos & SEALED) {
 			err = EOVERFLOW;
+			return 0;
+		}
+		used = pos - ALOAD(&seg->tail);
+		if ((i64)used < 0) { /* Stale head, the CAS would fail */
+			pos = ALOAD(&seg->head);
+			continue;
+		}
+		room = used >= seg->capacity ? 0 : seg->capacity - used;
+		if (room > n) room = n;
+		for (k = 0; k < room; k++)
+			if (ALOAD(SLOT_AT(seg, pos + k)) != pos + k) break;
+		if (!k) {
+			if (!room || (i64)(ALOAD(SLOT_AT(seg, pos)) - pos) < 0) {
+				err = EOVERFLOW;
+				return 0;
+			}
+			pos = ALOAD(&seg->head);
+			continue;
+		}
+		/* One CAS claims the whole run */
+		if (__cas64(&seg->head, &pos, pos + k)) break;
+	}
+
+	for (i = 0; i < k; i++) {
+		u64 *slot = SLOT_AT(seg, pos + i);
+		memcpy(SLOT_DATA(slot), (const u8 *)src + i * seg->element_size,
+		       seg->element_size);
+		ASTORE(slot, pos + i + 1);
+	}
+	return k;
+}
+
+i64 send_batch(Channel *channel, const void *src, u64 n) {
+	ChannelInner *inner = channel->inner, *seg;
+	u64 sent = 0, k;
+
+	if (!n) return 0;
+	/* Unbounded channels take the whole batch, a segment at a time */
+	do {
+		seg = send_segment(inner);
+		k = segment_send_batch(
+		    seg, (const u8 *)src + sent * inner->element_size, n - sent);
+		sent += k;
+		if (!k && IS_UNBOUNDED(inner) && channel_grow(inner, seg) < 0)
+			break;
+	} while (sent < n && IS_UNBOUNDED(inner));
+	if (!sent) return -1;
+	if (notify(inner, sent) < 0) return -1;
+	return sent;
+}
+
+STATIC u64 segment_recv_batch(ChannelInner *inner, ChannelInner *seg,
+			      void *dst, u64 max) {
+	u64 pos = ALOAD(&seg->tail), seq, k, i;
+
+	while (true) {
+		for (k = 0; k < max; k++)
+			if (ALOAD(SLOT_AT(seg, pos + k)) != pos + k + 1) break;
+		if (!k) {
+			seq = ALOAD(SLOT_AT(seg, pos));
+			if ((i64)(seq - (pos + 1)) < 0) return 0;
+			pos = ALOAD(&seg->tail);
+			continue;
+		}
+		if (segment_stale(inner, seg)) return 0;
+		if (__cas64(&seg->tail, &pos, pos + k)) break;
+	}
+
+	for (i = 0; i < k; i++) {
+		u64 *slot = SLOT_AT(seg, pos + i);
+		memcpy((u8 *)dst + i * seg->element_size, SLOT_DATA(slot),
+		       seg->element_size);
+		ASTORE(slot, pos + i + seg->mask + 1);
+	}
+	return k;
+}
+
+STATIC u64 recv_batch_now(ChannelInner *inner, void *dst, u64 max) {
+	ChannelInner *seg;
+	u64 k;
+	do {
+		seg = recv_segment(inner);
+		if ((k = segment_recv_batch(inner, seg, dst, max))) {
+			notify_space(inner, k);
+			return k;
+		}
+	} while (channel_advance(inner, seg) || segment_stale(inner, seg));
+	return 0;
+}
+
+i64 recv_batch(Channel *channel, void *dst, u64 max, i64 timeout_ms) {
+	ChannelInner *inner = channel->inner;
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	i64 deadline = 0;
+	u64 n;
+	u32 wait;
+
+	if (!max) return 0;
+	if ((n = recv_batch_now(inner, dst, max))) return n;
+	if (!timeout_ms) {
+		err = EAGAIN;
+		return -1;
+	}
+	if (timeout_ms > 0) deadline = micros() + timeout_ms * 1000;
+
+	while (spin_wait(&sw))
+		if ((n = recv_batch_now(inner, dst, max))) return n;
+	while (true) {
+		__add32(&inner->waiters, 1);
+		wait = ALOAD(&inner->wait);
+		if ((n = recv_batch_now(inner, dst, max))) {
+			__sub32(&inner->waiters, 1);
+			return n;
+		}
+		if (channel_sleep(&inner->wait, wait, deadline) < 0) {
+			__sub32(&inner->waiters, 1);
+			return -1;
+		}
+		__sub32(&inner->waiters, 1);
+	}
+}
+
+i32 recv_timeout(Channel *channel, void *dst, i64 timeout_ms) {
+	return recv_batch(channel, dst, 1, timeout_ms) < 0 ? -1 : 0;
+}
+
+i64 channel_select(Channel *channels, u64 n, i64 timeout_ms) {
+	struct futex_waitv waiters[FUTEX_WAITV_MAX];
+	struct timespec ts;
+	i64 deadline = 0, ret;
+	u64 i;
+
+	if (!channels || !n || n > FUTEX_WAITV_MAX) {
+		err = EINVAL;
+		return -1;
+	}
+	if (timeout_ms > 0) deadline = micros() + timeout_ms * 1000;
+
+	while (true) {
+		for (i = 0; i < n; i++)
+			if (channel_pending(channels[i].inner)) return i;
+		if (!timeout_ms) {
+			err = EAGAIN;
 			return -1;
 		}
-		memcpy(ELEMENT_AT(channel, head), src,
-		       channel->inner->element_size);
-	} while (
-	    !__cas64(&channel->inner->head, &head, NEXT_POS(channel, head)));
+		if (deadline && micros() >= deadline) {
+			err = ETIMEDOUT;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			ChannelInner *inner = channels[i].inner;
+			__add32(&inner->waiters, 1);
+			waiters[i].val = ALOAD(&inner->wait);
+			waiters[i].uaddr = (u64)&inner->wait;
+			waiters[i].flags = FUTEX_32;
+			waiters[i].__reserved = 0;
+		}
+		for (ret = -1, i = 0; i < n && ret < 0; i++)
+			if (channel_pending(channels[i].inner)) ret = i;
+		if (ret < 0) {
+			ts.tv_sec = deadline / 1000000;
+			ts.tv_nsec = (deadline % 1000000) * 1000;
+			if (futex_waitv(waiters, n, 0, deadline ? &ts : NULL,
+					CLOCK_REALTIME) < 0 &&
+			    err == ENOSYS) /* Before Linux 5.16, poll */
+				channel_sleep(&channels[0].inner->wait,
+					      waiters[0].val, micros() + 1000);
+		}
+		for (i = 0; i < n; i++) __sub32(&channels[i].inner->waiters, 1);
+		if (ret >= 0) return ret;
+	}
+}
 
-	num_messages = (tail >= head)
-			   ? (tail - head)
-			   : (tail - head + channel->inner->capacity);
+i32 channel_eventfd(Channel *channel) {
+	ChannelInner *inner = channel->inner;
+	u32 expected = (u32)-1;
+	i32 fd;
 
-	return notify(channel, num_messages);
+	if (ALOAD(&inner->efd) >= 0) return inner->efd;
+	if ((fd = eventfd(0, EFD_NONBLOCK)) < 0) return -1;
+	if (!__cas32((u32 *)&inner->efd, &expected, fd)) {
+		close(fd);
+		return inner->efd;
+	}
+	channel_event_ack(channel);
+	if (channel_pending(inner)) signal_event(inner);
+	return fd;
 }
 
+void channel_event_ack(Channel *channel) {
+	ChannelInner *inner = channel->inner;
+	u64 v;
+	read(inner->efd, &v, sizeof(v));
+	ASTORE(&inner->armed, 1);
+	/* Senders that publish after this see armed */
+	AFENCE();
+}
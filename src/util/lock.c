@@ -28,57 +28,255 @@
 #include <libfam/limits.H>
 #include <libfam/lock.H>
 #include <libfam/misc.H>
+#include <libfam/spin.H>
 #include <libfam/sys.H>
 #include <libfam/syscall.H>
 #include <libfam/syscall_const.H>
 
+/* Defines the functions behind the LOCKPROF macros */
+#undef rlock
+#undef wlock
+#undef fair_rlock
+#undef fair_wlock
+
 #define WFLAG (0x1 << 31)
 #define WREQUEST (0x1 << 30)
+#define WAITERS (0x1 << 29) /* someone sleeps in futex, unlock must wake */
+#define READERS (WAITERS - 1)
 
 void lockguard_cleanup(LockGuardImpl *lg) {
+#if LOCKPROF == 1
+	if (lg->site) lockprof_hold(lg->site, cpu_ticks() - lg->start);
+#endif /* LOCKPROF */
 	if (lg->is_write) {
 		Lock cur = ALOAD(lg->lock);
-		if (cur == 0U || cur == WREQUEST)
-			panic("invalid lock state 1: {}", cur);
-		__and32(lg->lock, WREQUEST);
-		futex(lg->lock, FUTEX_WAKE, I32_MAX, NULL, NULL, 0);
+		if (!(cur & WFLAG)) panic("invalid lock state 1: {}", cur);
+		/* A waiting writer keeps its request, everything else clears */
+		while (!__cas32(lg->lock, &cur, cur & WREQUEST));
+		if (cur & WAITERS)
+			futex(lg->lock, FUTEX_WAKE, I32_MAX, NULL, NULL, 0);
 	} else {
 		Lock cur = ALOAD(lg->lock);
-		if (cur == 0U || cur == (u32)WFLAG)
-			panic("invalid lock state 2");
+		if ((cur & READERS) == 0) panic("invalid lock state 2");
 		u32 v = __sub32(lg->lock, 1);
-		if ((v & ~(WREQUEST | WFLAG)) == 1)
-			futex(lg->lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+		if ((v & READERS) == 1 && (v & WAITERS)) {
+			/* Last reader out: hand over to the sleepers */
+			cur = v - 1;
+			while ((cur & WAITERS) && !(cur & READERS) &&
+			       !__cas32(lg->lock, &cur, cur & ~WAITERS));
+			if ((cur & WAITERS) && !(cur & READERS))
+				futex(lg->lock, FUTEX_WAKE, I32_MAX, NULL,
+				      NULL, 0);
+		}
 	}
 }
 
-LockGuardImpl rlock(Lock *lock) {
-	LockGuardImpl ret = {NULL, false};
+LockGuardImpl rlock_stats(Lock *lock, WaitStats *stats) {
+	LockGuardImpl ret = {0};
+	SpinWait sw = SPIN_WAIT_INIT(stats);
 	ret.lock = lock;
 	while (true) {
 		u32 cur = ALOAD(lock);
 		if ((cur & (WREQUEST | WFLAG)) == 0) {
 			if (__cas32(lock, &cur, cur + 1)) break;
-		} else
-			futex(lock, FUTEX_WAIT, cur, NULL, NULL, 0);
+		} else if (!spin_wait(&sw)) {
+			if (!(cur & WAITERS) &&
+			    !__cas32(lock, &cur, cur | WAITERS))
+				continue;
+			spin_sleep(&sw, lock, cur | WAITERS, NULL);
+		}
 	}
 	return ret;
 }
 
-LockGuardImpl wlock(Lock *lock) {
-	LockGuardImpl ret = {NULL, true};
+LockGuardImpl wlock_stats(Lock *lock, WaitStats *stats) {
+	LockGuardImpl ret = {0};
+	SpinWait sw = SPIN_WAIT_INIT(stats);
 	ret.lock = lock;
+	ret.is_write = true;
 	while (true) {
 		u32 cur = ALOAD(lock);
-		if ((cur & ~WREQUEST) == 0) {
-			if (__cas32(lock, &cur, WFLAG)) break;
+		if ((cur & ~(WREQUEST | WAITERS)) == 0) {
+			if (__cas32(lock, &cur, WFLAG | (cur & WAITERS))) break;
 		} else {
-			if ((cur & WREQUEST) == 0) {
-				i32 desired = cur | WREQUEST;
-				if (!__cas32(lock, &cur, desired)) continue;
+			u32 desired = cur | WREQUEST;
+			if (spin_wait(&sw)) {
+				/* Announce the writer so new readers back off */
+				if (!(cur & WREQUEST)) __cas32(lock, &cur, desired);
+				continue;
 			}
-			futex(lock, FUTEX_WAIT, cur | WREQUEST, NULL, NULL, 0);
+			desired |= WAITERS;
+			if (cur != desired && !__cas32(lock, &cur, desired))
+				continue;
+			spin_sleep(&sw, lock, desired, NULL);
+		}
+	}
+	return ret;
+}
+
+LockGuardImpl rlock(Lock *lock) { return rlock_stats(lock, NULL); }
+
+LockGuardImpl wlock(Lock *lock) { return wlock_stats(lock, NULL); }
+
+#if LOCKPROF == 1
+STATIC LockGuardImpl lock_at(Lock *lock, bool is_write, const u8 *file,
+			     u32 line) {
+	WaitStats stats = {0};
+	u64 start = cpu_ticks();
+	LockGuardImpl ret = is_write ? wlock_stats(lock, &stats)
+				     : rlock_stats(lock, &stats);
+	ret.site = lockprof_site(file, line,
+				 is_write ? LOCKPROF_WLOCK : LOCKPROF_RLOCK);
+	ret.start = cpu_ticks();
+	lockprof_wait(ret.site, ret.start - start, stats.spins || stats.sleeps);
+	return ret;
+}
+
+LockGuardImpl rlock_at(Lock *lock, const u8 *file, u32 line) {
+	return lock_at(lock, false, file, line);
+}
+
+LockGuardImpl wlock_at(Lock *lock, const u8 *file, u32 line) {
+	return lock_at(lock, true, file, line);
+}
+#endif /* LOCKPROF */
+
+/* Ticket words: writes in the top half wrap harmlessly, reads in the low 15
+ * bits carry into a guard bit that is cleared again. */
+#define TICKET_READ 0x1
+#define TICKET_WRITE 0x10000
+#define TICKET_GUARD 0x8000
+#define TICKET(v) ((v) & ~TICKET_GUARD)
+#define TICKET_WRITES(v) ((v) >> 16)
+#define TICKET_READS(v) ((v) & (TICKET_GUARD - 1))
+/* Futex bitset bits: readers by writer generation, then writers */
+#define COHORT_READERS(gen) (1U << ((gen) & 15))
+#define COHORT_WRITER(gen) (1U << (((gen) & 15) + 16))
+
+STATIC u32 ticket_add(u32 *word, u32 inc) {
+	u32 prev = __add32(word, inc);
+	if (inc == TICKET_READ && TICKET_READS(prev) == TICKET_GUARD - 1)
+		__sub32(word, TICKET_GUARD);
+	return TICKET(prev);
+}
+
+STATIC bool ticket_ready(u32 done, u32 ticket, bool is_write) {
+	done = TICKET(done);
+	if (is_write) return done == ticket;
+	return TICKET_WRITES(done) == TICKET_WRITES(ticket);
+}
+
+STATIC void lock_hist_add(u64 *hist, u64 ticks) {
+	u32 bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+	if (bucket >= LOCK_HIST_BUCKETS) bucket = LOCK_HIST_BUCKETS - 1;
+	__add64(&hist[bucket], 1);
+}
+
+/* Sets *waited when the ticket was not served right away */
+STATIC FairLockGuardImpl fair_lock(FairLock *lock, bool is_write,
+				   bool *waited) {
+	FairLockGuardImpl ret = {0};
+	SpinWait sw = SPIN_WAIT_INIT(lock->stats ? &lock->stats->waits : NULL);
+	u32 ticket, done, bit;
+
+	ret.lock = lock;
+	ret.is_write = is_write;
+	if (lock->stats) ret.start = cpu_ticks();
+	ticket = ticket_add(&lock->requests,
+			    is_write ? TICKET_WRITE : TICKET_READ);
+	bit = is_write ? COHORT_WRITER(TICKET_WRITES(ticket))
+		       : COHORT_READERS(TICKET_WRITES(ticket));
+	while (!ticket_ready(ALOAD(&lock->done), ticket, is_write)) {
+		*waited = true;
+		if (spin_wait(&sw)) continue;
+		__add32(&lock->waiters, 1);
+		/* Once only readers are ahead, the last of them must know
+		 * whom to wake. There is one such writer at a time. */
+		if (is_write && TICKET_WRITES(TICKET(ALOAD(&lock->done))) ==
+				    TICKET_WRITES(ticket))
+			ASTORE(&lock->writer_ticket, ticket);
+		/* Pairs with the fence in unlock: either it sees us or we
+		 * see its update */
+		AFENCE();
+		done = ALOAD(&lock->done);
+		if (!ticket_ready(done, ticket, is_write)) {
+			if (sw.stats) sw.stats->sleeps++;
+			futex(&lock->done, FUTEX_WAIT_BITSET, done, NULL, NULL,
+			      bit);
 		}
+		__sub32(&lock->waiters, 1);
+	}
+	if (lock->stats) {
+		u64 now = cpu_ticks();
+		lock_hist_add(lock->stats->wait_hist, now - ret.start);
+		ret.start = now;
 	}
 	return ret;
 }
+
+void fairlockguard_cleanup(FairLockGuardImpl *lg) {
+	FairLock *lock = lg->lock;
+	u32 done, gen, bits;
+
+#if LOCKPROF == 1
+	if (lg->site) lockprof_hold(lg->site, cpu_ticks() - lg->site_start);
+#endif /* LOCKPROF */
+	if (lock->stats)
+		lock_hist_add(lock->stats->hold_hist, cpu_ticks() - lg->start);
+	if (lg->is_write) {
+		done = TICKET(ticket_add(&lock->done, TICKET_WRITE) +
+			      TICKET_WRITE);
+		AFENCE();
+		if (!ALOAD(&lock->waiters)) return;
+		/* The readers queued behind us, and the next writer, which
+		 * either goes now or waits for those readers */
+		gen = TICKET_WRITES(done);
+		bits = COHORT_READERS(gen) | COHORT_WRITER(gen);
+		futex(&lock->done, FUTEX_WAKE_BITSET, I32_MAX, NULL, NULL, bits);
+	} else {
+		done = TICKET(ticket_add(&lock->done, TICKET_READ) + TICKET_READ);
+		AFENCE();
+		/* Only the last reader of a cohort has a writer to hand to */
+		if (ALOAD(&lock->waiters) && ALOAD(&lock->writer_ticket) == done)
+			futex(&lock->done, FUTEX_WAKE_BITSET, 1, NULL, NULL,
+			      COHORT_WRITER(TICKET_WRITES(done)));
+	}
+}
+
+void fair_lock_init(FairLock *lock, FairLockStats *stats) {
+	lock->requests = lock->done = lock->waiters = 0;
+	lock->writer_ticket = TICKET_GUARD; /* never a valid ticket */
+	lock->stats = stats;
+}
+
+FairLockGuardImpl fair_rlock(FairLock *lock) {
+	bool waited = false;
+	return fair_lock(lock, false, &waited);
+}
+
+FairLockGuardImpl fair_wlock(FairLock *lock) {
+	bool waited = false;
+	return fair_lock(lock, true, &waited);
+}
+
+#if LOCKPROF == 1
+STATIC FairLockGuardImpl fair_lock_at(FairLock *lock, bool is_write,
+				      const u8 *file, u32 line) {
+	bool waited = false;
+	u64 start = cpu_ticks();
+	FairLockGuardImpl ret = fair_lock(lock, is_write, &waited);
+	ret.site = lockprof_site(
+	    file, line, is_write ? LOCKPROF_FAIR_WLOCK : LOCKPROF_FAIR_RLOCK);
+	ret.site_start = cpu_ticks();
+	lockprof_wait(ret.site, ret.site_start - start, waited);
+	return ret;
+}
+
+FairLockGuardImpl fair_rlock_at(FairLock *lock, const u8 *file, u32 line) {
+	return fair_lock_at(lock, false, file, line);
+}
+
+FairLockGuardImpl fair_wlock_at(FairLock *lock, const u8 *file, u32 line) {
+	return fair_lock_at(lock, true, file, line);
+}
+#endif /* LOCKPROF */
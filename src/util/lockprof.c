@@ -0,0 +1,170 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/atomic.H>
+#include <libfam/error.H>
+#include <libfam/lockprof.H>
+#include <libfam/misc.H>
+#include <libfam/spin.H>
+#include <libfam/syscall.H>
+
+#define SITE_FREE 0
+#define SITE_CLAIMED 1
+#define SITE_READY 2
+
+STATIC LockProfSite *_lockprof_sites__ = NULL;
+
+STATIC const u8 *lockprof_kind_name(LockProfKind kind) {
+	switch (kind) {
+		case LOCKPROF_RLOCK:
+			return "rlock";
+		case LOCKPROF_WLOCK:
+			return "wlock";
+		case LOCKPROF_ROBUST:
+			return "robust_lock";
+		case LOCKPROF_RECV:
+			return "recv";
+		case LOCKPROF_FAIR_RLOCK:
+			return "fair_rlock";
+		case LOCKPROF_FAIR_WLOCK:
+			return "fair_wlock";
+	}
+	return "unknown";
+}
+
+STATIC void lockprof_max(u64 *max, u64 value) {
+	u64 cur = ALOAD(max);
+	while (value > cur && !__cas64(max, &cur, value));
+}
+
+i32 lockprof_init(void) {
+	LockProfSite *sites;
+	u64 expected = 0;
+
+	if (ALOAD(&_lockprof_sites__)) return 0;
+	sites = smap(sizeof(LockProfSite) * LOCKPROF_MAX_SITES);
+	if (!sites) return -1;
+	if (!__cas64((u64 *)&_lockprof_sites__, &expected, (u64)sites))
+		munmap(sites, sizeof(LockProfSite) * LOCKPROF_MAX_SITES);
+	return 0;
+}
+
+LockProfSite *lockprof_site(const u8 *file, u32 line, LockProfKind kind) {
+	LockProfSite *site;
+	u64 i, h;
+	u32 state;
+
+	if (!_lockprof_sites__ && lockprof_init() < 0) return NULL;
+	h = ((u64)file >> 3) * 31 + line * 7 + kind;
+	for (i = 0; i < LOCKPROF_MAX_SITES; i++) {
+		site = &_lockprof_sites__[(h + i) % LOCKPROF_MAX_SITES];
+		state = ALOAD(&site->state);
+		if (state == SITE_FREE) {
+			if (__cas32(&site->state, &state, SITE_CLAIMED)) {
+				site->file = file;
+				site->line = line;
+				site->kind = kind;
+				ASTORE(&site->state, SITE_READY);
+				return site;
+			}
+		}
+		while (state == SITE_CLAIMED) {
+			cpu_relax();
+			state = ALOAD(&site->state);
+		}
+		if (site->file == file && site->line == line &&
+		    site->kind == kind)
+			return site;
+	}
+	return NULL;
+}
+
+void lockprof_wait(LockProfSite *site, u64 ticks, bool contended) {
+	if (!site) return;
+	__add64(&site->acquisitions, 1);
+	if (contended) __add64(&site->contended, 1);
+	__add64(&site->wait_ticks, ticks);
+	lockprof_max(&site->max_wait_ticks, ticks);
+}
+
+void lockprof_hold(LockProfSite *site, u64 ticks) {
+	if (!site) return;
+	__add64(&site->hold_ticks, ticks);
+	lockprof_max(&site->max_hold_ticks, ticks);
+}
+
+i32 lockprof_format(Formatter *f) {
+	LockProfSite *order[LOCKPROF_MAX_SITES], *site;
+	u64 n = 0, i, j;
+
+	if (!f) {
+		err = EINVAL;
+		return -1;
+	}
+	if (!_lockprof_sites__) return 0;
+	for (i = 0; i < LOCKPROF_MAX_SITES; i++) {
+		site = &_lockprof_sites__[i];
+		if (ALOAD(&site->state) != SITE_READY) continue;
+		for (j = n++; j > 0 && order[j - 1]->wait_ticks <
+					       site->wait_ticks;
+		     j--)
+			order[j] = order[j - 1];
+		order[j] = site;
+	}
+	for (i = 0; i < n; i++) {
+		site = order[i];
+		/* A receive holds nothing and its wait is the blocking
+		 * receive, so count the calls that found the channel empty */
+		if (site->kind == LOCKPROF_RECV) {
+			format(f,
+			       "{}:{} {}: calls={} empty={} wait={} "
+			       "max_wait={}\n",
+			       site->file, site->line,
+			       lockprof_kind_name(site->kind),
+			       site->acquisitions, site->contended,
+			       site->wait_ticks, site->max_wait_ticks);
+			continue;
+		}
+		format(f,
+		       "{}:{} {}: acquisitions={} contended={} wait={} "
+		       "max_wait={} hold={} max_hold={}\n",
+		       site->file, site->line, lockprof_kind_name(site->kind),
+		       site->acquisitions, site->contended, site->wait_ticks,
+		       site->max_wait_ticks, site->hold_ticks,
+		       site->max_hold_ticks);
+	}
+	return 0;
+}
+
+void lockprof_reset(void) {
+	u64 i;
+	if (!_lockprof_sites__) return;
+	for (i = 0; i < LOCKPROF_MAX_SITES; i++) {
+		LockProfSite *site = &_lockprof_sites__[i];
+		site->acquisitions = site->contended = 0;
+		site->wait_ticks = site->max_wait_ticks = 0;
+		site->hold_ticks = site->max_hold_ticks = 0;
+	}
+}
@@ -0,0 +1,174 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/alloc.H>
+#include <libfam/atomic.H>
+#include <libfam/error.H>
+#include <libfam/misc.H>
+#include <libfam/pool.H>
+
+#define POOL_BLOCK_SIZE (64 * 1024)
+#define POOL_MIN_PER_BLOCK 16
+#define POOL_CLOSING (1UL << 63)
+/* User space addresses fit in 48 bits; the rest of the head is an ABA tag */
+#define POOL_PTR_BITS 48
+#define POOL_PTR_MASK ((1UL << POOL_PTR_BITS) - 1)
+#define POOL_TAG_ONE (1UL << POOL_PTR_BITS)
+
+typedef struct PoolBlock {
+	struct PoolBlock *next;
+	u64 padding;
+} PoolBlock;
+
+struct Pool {
+	u64 head;
+	u64 state; /* outstanding objects, POOL_CLOSING once destroyed */
+	PoolBlock *blocks;
+	u64 stride;
+	u64 align;
+	u64 offset; /* object start within a slot, after its owner word */
+	u64 per_block;
+};
+
+#define NEXT_OF(obj) (*(u64 *)(obj))
+#define OWNER_OF(obj) (((Pool **)(obj))[-1])
+
+STATIC void pool_free(Pool *p) {
+	PoolBlock *block = p->blocks;
+	while (block) {
+		PoolBlock *next = block->next;
+		release(block);
+		block = next;
+	}
+	release(p);
+}
+
+/* Pushes the already linked chain first..last with one CAS */
+STATIC void pool_push(Pool *p, void *first, void *last) {
+	u64 head;
+	do {
+		head = ALOAD(&p->head);
+		NEXT_OF(last) = head & POOL_PTR_MASK;
+	} while (!__cas64(&p->head, &head,
+			  (u64)first | ((head & ~POOL_PTR_MASK) + POOL_TAG_ONE)));
+}
+
+STATIC i32 pool_grow(Pool *p) {
+	PoolBlock *block, *expected;
+	u64 i, base;
+
+	block = alloc(sizeof(PoolBlock) + p->align + p->stride * p->per_block);
+	if (!block) return -1;
+	base = ((u64)block + sizeof(PoolBlock) + p->align - 1) & ~(p->align - 1);
+	base += p->offset;
+	for (i = 0; i < p->per_block; i++) {
+		OWNER_OF(base + i * p->stride) = p;
+		if (i + 1 < p->per_block)
+			NEXT_OF(base + i * p->stride) =
+			    base + (i + 1) * p->stride;
+	}
+
+	do {
+		expected = ALOAD(&p->blocks);
+		block->next = expected;
+	} while (!__cas64((u64 *)&p->blocks, (u64 *)&expected, (u64)block));
+	pool_push(p, (void *)base,
+		  (void *)(base + (p->per_block - 1) * p->stride));
+	return 0;
+}
+
+Pool *pool_create(u64 obj_size, u64 align) {
+	Pool *p;
+	if (!obj_size || !align || (align & (align - 1)) ||
+	    obj_size > POOL_BLOCK_SIZE || align > POOL_BLOCK_SIZE) {
+		err = EINVAL;
+		return NULL;
+	}
+	if (!(p = alloc(sizeof(Pool)))) return NULL;
+	if (align < sizeof(u64)) align = sizeof(u64);
+	p->head = 0;
+	p->state = 0;
+	p->blocks = NULL;
+	p->align = align;
+	p->offset = align < sizeof(Pool *) ? sizeof(Pool *) : align;
+	p->stride = p->offset + ((obj_size + align - 1) & ~(align - 1));
+	p->per_block = POOL_BLOCK_SIZE / p->stride;
+	if (p->per_block < POOL_MIN_PER_BLOCK) p->per_block = POOL_MIN_PER_BLOCK;
+	return p;
+}
+
+void pool_destroy(Pool *p) {
+	u64 state;
+	if (!p) return;
+	do {
+		state = ALOAD(&p->state);
+	} while (!__cas64(&p->state, &state, state | POOL_CLOSING));
+	if (!state) pool_free(p);
+}
+
+STATIC void *pool_pop(Pool *p) {
+	u64 head;
+	void *obj;
+	do {
+		head = ALOAD(&p->head);
+		obj = (void *)(head & POOL_PTR_MASK);
+		if (!obj && pool_grow(p) < 0) return NULL;
+		/* Blocks stay mapped until pool_destroy, so reading the link
+		 * of a slot that was popped meanwhile is harmless; the tag
+		 * makes the CAS fail */
+	} while (!obj || !__cas64(&p->head, &head,
+				 NEXT_OF(obj) | ((head & ~POOL_PTR_MASK) +
+						 POOL_TAG_ONE)));
+	return obj;
+}
+
+u64 pool_get_bulk(Pool *p, void **objs, u64 n) {
+	u64 count;
+	if (!p || !n) return 0;
+	__add64(&p->state, n);
+	for (count = 0; count < n; count++)
+		if (!(objs[count] = pool_pop(p))) break;
+	if (count < n) __sub64(&p->state, n - count);
+	return count;
+}
+
+void *pool_get(Pool *p) {
+	void *obj;
+	return pool_get_bulk(p, &obj, 1) ? obj : NULL;
+}
+
+void pool_put_bulk(Pool *p, void **objs, u64 n) {
+	u64 i;
+	if (!p || !n) return;
+	for (i = 0; i + 1 < n; i++) NEXT_OF(objs[i]) = (u64)objs[i + 1];
+	pool_push(p, objs[0], objs[n - 1]);
+	if (__sub64(&p->state, n) == (POOL_CLOSING | n)) pool_free(p);
+}
+
+void pool_put(Pool *p, void *obj) {
+	if (obj) pool_put_bulk(p, &obj, 1);
+}
+
+Pool *pool_of(void *obj) { return obj ? OWNER_OF(obj) : NULL; }
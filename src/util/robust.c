@@ -26,35 +26,130 @@
 #include <libfam/atomic.H>
 #include <libfam/error.H>
 #include <libfam/format.H>
+#include <libfam/macro_util.H>
 #include <libfam/misc.H>
 #include <libfam/robust.H>
+#include <libfam/spin.H>
 #include <libfam/sys.H>
 #include <libfam/syscall.H>
+#include <libfam/syscall_const.H>
 #include <libfam/types.H>
 
-RobustGuardImpl robust_lock(RobustLock *lock) {
-	RobustGuardImpl ret;
-	u32 expected = 0;
-	i32 pid = getpid();
-
-	while (!__cas32(lock, &expected, pid)) {
-		if (kill(expected, 0) == -1 && err == ESRCH)
-			if (__cas32(lock, &expected, pid)) {
-				err = EOWNERDEAD;
+/* Defines the function behind the LOCKPROF macro */
+#undef robust_lock
+
+/* How long a sleeper waits before asking whether the owner still exists,
+ * for owners that died without the kernel list knowing the lock */
+#define ROBUST_PROBE_MILLIS 100
+
+STATIC struct robust_list_head _robust_head__;
+STATIC i32 _robust_pid__ = 0;
+
+/* Registers this process's robust list on first use */
+STATIC i32 robust_self(void) {
+	if (!_robust_pid__) {
+		_robust_head__.list.next = &_robust_head__.list;
+		_robust_head__.futex_offset =
+		    (i64)offsetof(RobustLock, futex) -
+		    (i64)offsetof(RobustLock, link);
+		_robust_head__.list_op_pending = NULL;
+		set_robust_list(&_robust_head__, sizeof(_robust_head__));
+		_robust_pid__ = getpid();
+	}
+	return _robust_pid__;
+}
+
+void robust_list_reset(void) { _robust_pid__ = 0; }
+
+void robust_init(RobustLock *lock) {
+	lock->link.next = NULL;
+	lock->futex = 0;
+}
+
+STATIC RobustGuardImpl robust_lock_stats(RobustLock *lock, WaitStats *stats) {
+	RobustGuardImpl ret = {0};
+	SpinWait sw = SPIN_WAIT_INIT(stats);
+	struct timespec probe = {0, ROBUST_PROBE_MILLIS * 1000000};
+	u32 pid = robust_self(), waiters = 0, cur, expected;
+	bool owner_died = false;
+
+	/* Covers an exit between taking the word and linking it */
+	ASTORE(&_robust_head__.list_op_pending, &lock->link);
+	while (true) {
+		cur = ALOAD(&lock->futex);
+		if (!(cur & FUTEX_TID_MASK)) {
+			/* Free or abandoned. Once we slept, others may still
+			 * be asleep, so keep the waiters bit for our unlock. */
+			expected = cur;
+			if (__cas32(&lock->futex, &expected,
+				    pid | waiters | (cur & FUTEX_WAITERS))) {
+				owner_died = (cur & FUTEX_OWNER_DIED) != 0;
 				break;
 			}
-		expected = 0;
-		yield();
+			continue;
+		}
+		if (spin_wait(&sw)) continue;
+		if (!(cur & FUTEX_WAITERS)) {
+			expected = cur;
+			if (!__cas32(&lock->futex, &expected,
+				     cur | FUTEX_WAITERS))
+				continue;
+			cur |= FUTEX_WAITERS;
+		}
+		waiters = FUTEX_WAITERS;
+		if (stats) stats->sleeps++;
+		if (futex(&lock->futex, FUTEX_WAIT, cur, &probe, NULL, 0) < 0 &&
+		    err == ETIMEDOUT &&
+		    kill(cur & FUTEX_TID_MASK, 0) == -1 && err == ESRCH) {
+			expected = cur;
+			__cas32(&lock->futex, &expected,
+				(cur & FUTEX_WAITERS) | FUTEX_OWNER_DIED);
+		}
 	}
+	lock->link.next = _robust_head__.list.next;
+	_robust_head__.list.next = &lock->link;
+	ASTORE(&_robust_head__.list_op_pending, NULL);
+	if (owner_died) err = EOWNERDEAD;
 
 	ret.lock = lock;
 	return ret;
 }
 
+RobustGuardImpl robust_lock(RobustLock *lock) {
+	return robust_lock_stats(lock, NULL);
+}
+
+#if LOCKPROF == 1
+RobustGuardImpl robust_lock_at(RobustLock *lock, const u8 *file, u32 line) {
+	WaitStats stats = {0};
+	u64 start = cpu_ticks();
+	RobustGuardImpl ret = robust_lock_stats(lock, &stats);
+	ret.site = lockprof_site(file, line, LOCKPROF_ROBUST);
+	ret.start = cpu_ticks();
+	lockprof_wait(ret.site, ret.start - start, stats.spins || stats.sleeps);
+	return ret;
+}
+#endif /* LOCKPROF */
+
 void robustguard_cleanup(RobustGuardImpl *lg) {
-	i32 pid = getpid();
-	if (!__cas32(lg->lock, (u32 *)&pid, 0)) {
+	RobustLock *lock = lg->lock;
+	struct robust_list *prev = &_robust_head__.list;
+	u32 pid = robust_self(), cur = ALOAD(&lock->futex);
+
+#if LOCKPROF == 1
+	if (lg->site) lockprof_hold(lg->site, cpu_ticks() - lg->start);
+#endif /* LOCKPROF */
+	if ((cur & FUTEX_TID_MASK) != pid) {
 		err = EINVAL;
-		panic("unexpected lock state: {}. pid: {}", pid, getpid());
+		panic("unexpected lock state: {}. pid: {}", cur, pid);
 	}
+	ASTORE(&_robust_head__.list_op_pending, &lock->link);
+	/* Usually the most recent lock taken, so at the head */
+	while (prev->next != &lock->link && prev->next != &_robust_head__.list)
+		prev = prev->next;
+	if (prev->next == &lock->link) prev->next = lock->link.next;
+	lock->link.next = NULL;
+	while (!__cas32(&lock->futex, &cur, 0));
+	if (cur & FUTEX_WAITERS) futex(&lock->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+	ASTORE(&_robust_head__.list_op_pending, NULL);
 }
@@ -0,0 +1,95 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/atomic.H>
+#include <libfam/format.H>
+#include <libfam/limits.H>
+#include <libfam/misc.H>
+#include <libfam/seqlock.H>
+#include <libfam/spin.H>
+#include <libfam/syscall.H>
+#include <libfam/syscall_const.H>
+
+/* The count moves by one per writer entry and exit, odd while writing. The
+ * top bit marks sleepers (readers or writers) for the exiting writer. */
+#define SEQ_WAITERS (0x1U << 31)
+#define SEQ(v) ((v) & ~SEQ_WAITERS)
+
+/* Sleeps until the writer seen in cur leaves */
+STATIC void seq_wait(SeqLock *lock, u32 cur, SpinWait *sw) {
+	if (spin_wait(sw)) return;
+	if (!(cur & SEQ_WAITERS) &&
+	    !__cas32(lock, &cur, cur | SEQ_WAITERS))
+		return;
+	spin_sleep(sw, lock, cur | SEQ_WAITERS, NULL);
+}
+
+void seqguard_cleanup(SeqGuardImpl *sg) {
+	u32 cur = ALOAD(sg->lock);
+	if (!(SEQ(cur) & 1)) {
+		panic("invalid seqlock state: {}", cur);
+	}
+	while (!__cas32(sg->lock, &cur, SEQ(cur + 1)));
+	if (cur & SEQ_WAITERS) futex(sg->lock, FUTEX_WAKE, I32_MAX, NULL, NULL, 0);
+}
+
+u32 seq_read_begin(SeqLock *lock) {
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	u32 cur;
+	while ((cur = ALOAD(lock)) & 1) seq_wait(lock, cur, &sw);
+	return SEQ(cur);
+}
+
+bool seq_read_retry(const SeqLock *lock, u32 seq) {
+	/* The data reads complete before the count is looked at again */
+	AFENCE_ACQUIRE();
+	return SEQ(__atomic_load_n(lock, __ATOMIC_RELAXED)) != seq;
+}
+
+void seq_read(SeqLock *lock, void *dst, const void *src, u64 len) {
+	u32 seq;
+	do {
+		seq = seq_read_begin(lock);
+		memcpy(dst, src, len);
+	} while (seq_read_retry(lock, seq));
+}
+
+SeqGuardImpl seq_write_lock(SeqLock *lock) {
+	SeqGuardImpl ret;
+	SpinWait sw = SPIN_WAIT_INIT(NULL);
+	u32 cur;
+
+	while (true) {
+		cur = ALOAD(lock);
+		if (cur & 1)
+			seq_wait(lock, cur, &sw);
+		else if (__cas32(lock, &cur, cur + 1))
+			break;
+	}
+	/* Readers must see the odd count before any of the new data */
+	AFENCE_RELEASE();
+	ret.lock = lock;
+	return ret;
+}
@@ -0,0 +1,51 @@
+/********************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2025 Christopher Gilliard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *******************************************************************************/
+
+#include <libfam/spin.H>
+#include <libfam/syscall.H>
+#include <libfam/syscall_const.H>
+
+STATIC u32 _spin_limit__ = SPIN_LIMIT_DEFAULT;
+
+PUBLIC void spin_set_limit(u32 rounds) { _spin_limit__ = rounds; }
+
+PUBLIC u32 spin_limit(void) { return _spin_limit__; }
+
+PUBLIC bool spin_wait(SpinWait *sw) {
+	u32 pauses, i;
+
+	if (sw->rounds >= _spin_limit__) return false;
+	pauses = sw->rounds < 6 ? 1U << sw->rounds : SPIN_MAX_PAUSES;
+	for (i = 0; i < pauses; i++) cpu_relax();
+	sw->rounds++;
+	if (sw->stats) sw->stats->spins++;
+	return true;
+}
+
+PUBLIC void spin_sleep(SpinWait *sw, u32 *addr, u32 val,
+		       const struct timespec *timeout) {
+	if (sw->stats) sw->stats->sleeps++;
+	futex(addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
@@ -24,17 +24,25 @@
  *******************************************************************************/
 
 #include <libfam/alloc.H>
+#include <libfam/arena.H>
 #include <libfam/atomic.H>
+#include <libfam/broadcast.H>
+#include <libfam/bytering.H>
 #include <libfam/channel.H>
 #include <libfam/compress.H>
 #include <libfam/crc32c.H>
 #include <libfam/error.H>
+#include <libfam/event.H>
 #include <libfam/huffman.H>
 #include <libfam/limits.H>
 #include <libfam/lock.H>
+#include <libfam/lockprof.H>
+#include <libfam/pool.H>
 #include <libfam/rbtree.H>
 #include <libfam/rng.H>
+#include <libfam/spin.H>
 #include <libfam/robust.H>
+#include <libfam/seqlock.H>
 #include <libfam/syscall_const.H>
 #include <libfam/test.H>
 #include <libfam/vec.H>
@@ -223,6 +231,258 @@ Test(lock2) {
 	ASSERT_EQ(l2, U32_MAX, "l2=U32_MAX");
 }
 
+typedef struct {
+	FairLock lock;
+	FairLockStats stats;
+	u64 a;
+	u64 b;
+	u64 torn;
+	u32 order[3];
+	u32 next;
+} FairLockState;
+
+#define FAIR_LOCK_PROCS 4
+#define FAIR_LOCK_ITERS 1000
+
+Test(fair_lock) {
+	FairLock l = FAIR_LOCK_INIT;
+	FairLockState *state = smap(sizeof(FairLockState));
+	i32 pids[FAIR_LOCK_PROCS], i, j;
+	u64 waits = 0, holds = 0;
+
+	ASSERT(state, "smap");
+	{
+		FairLockGuard lg1 = fair_rlock(&l);
+		FairLockGuard lg2 = fair_rlock(&l);
+		ASSERT_EQ(l.requests, 2, "two readers");
+	}
+	ASSERT_EQ(l.done, 2, "released");
+	{
+		FairLockGuard lg = fair_wlock(&l);
+		ASSERT_EQ(l.requests, 0x10002, "writer");
+	}
+	/* Read tickets wrap without touching the writes */
+	l.requests = l.done = 0x7FFF;
+	{
+		FairLockGuard lg1 = fair_rlock(&l);
+		FairLockGuard lg2 = fair_rlock(&l);
+	}
+	ASSERT_EQ(l.done, 1, "wrapped");
+	{
+		FairLockGuard lg = fair_wlock(&l);
+	}
+	ASSERT_EQ(l.done, 0x10001, "writes intact");
+
+	/* A queued writer holds back the readers that come after it */
+	fair_lock_init(&state->lock, NULL);
+	{
+		FairLockGuardImpl lg = fair_rlock(&state->lock);
+		if (!(pids[0] = two())) {
+			{
+				FairLockGuard lg2 = fair_wlock(&state->lock);
+				state->order[__add32(&state->next, 1)] = 1;
+			}
+			exit(0);
+		}
+		while (!(ALOAD(&state->lock.requests) >> 16)) yield();
+		if (!(pids[1] = two())) {
+			{
+				FairLockGuard lg2 = fair_rlock(&state->lock);
+				state->order[__add32(&state->next, 1)] = 2;
+			}
+			exit(0);
+		}
+		sleep(10);
+		ASSERT_EQ(ALOAD(&state->next), 0, "all queued");
+		fairlockguard_cleanup(&lg);
+	}
+	waitid(P_PID, pids[0], NULL, WEXITED);
+	waitid(P_PID, pids[1], NULL, WEXITED);
+	ASSERT_EQ(state->order[0], 1, "writer first");
+	ASSERT_EQ(state->order[1], 2, "then reader");
+
+	fair_lock_init(&state->lock, &state->stats);
+	for (i = 0; i < FAIR_LOCK_PROCS; i++) {
+		if (!(pids[i] = two())) {
+			for (j = 0; j < FAIR_LOCK_ITERS; j++) {
+				if (j % 4) {
+					FairLockGuard lg =
+					    fair_rlock(&state->lock);
+					if (state->a != state->b) state->torn++;
+				} else {
+					FairLockGuard lg =
+					    fair_wlock(&state->lock);
+					state->a++;
+					yield();
+					state->b++;
+				}
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < FAIR_LOCK_PROCS; i++)
+		waitid(P_PID, pids[i], NULL, WEXITED);
+	ASSERT_EQ(state->torn, 0, "readers excluded");
+	ASSERT_EQ(state->a, FAIR_LOCK_PROCS * FAIR_LOCK_ITERS / 4, "writes");
+	for (i = 0; i < LOCK_HIST_BUCKETS; i++) {
+		waits += state->stats.wait_hist[i];
+		holds += state->stats.hold_hist[i];
+	}
+	ASSERT_EQ(waits, FAIR_LOCK_PROCS * FAIR_LOCK_ITERS, "wait samples");
+	ASSERT_EQ(holds, FAIR_LOCK_PROCS * FAIR_LOCK_ITERS, "hold samples");
+	munmap(state, sizeof(FairLockState));
+}
+
+typedef struct {
+	SeqLock lock;
+	u64 a;
+	u64 b;
+	u64 c;
+	u64 torn;
+	u32 done;
+} SeqState;
+
+#define SEQLOCK_READERS 3
+#define SEQLOCK_WRITERS 2
+#define SEQLOCK_WRITES 20000
+
+Test(seqlock) {
+	SeqLock l = SEQLOCK_INIT;
+	SeqState *state = smap(sizeof(SeqState));
+	i32 pids[SEQLOCK_READERS + SEQLOCK_WRITERS], i;
+	u32 seq;
+
+	ASSERT(state, "smap");
+	seq = seq_read_begin(&l);
+	ASSERT(!seq_read_retry(&l, seq), "no writer");
+	{
+		SeqGuard sg = seq_write_lock(&l);
+		ASSERT_EQ(l, 1, "odd while writing");
+	}
+	ASSERT(seq_read_retry(&l, seq), "writer ran");
+	ASSERT_EQ(seq_read_begin(&l), 2, "even after");
+
+	state->lock = SEQLOCK_INIT;
+	for (i = 0; i < SEQLOCK_READERS; i++) {
+		if (!(pids[i] = two())) {
+			u64 snap[3];
+			while (!ALOAD(&state->done)) {
+				seq_read(&state->lock, snap, &state->a,
+					 sizeof(snap));
+				if (snap[1] != snap[0] * 3 ||
+				    snap[2] != snap[0] * 7)
+					__add64(&state->torn, 1);
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < SEQLOCK_WRITERS; i++) {
+		if (!(pids[SEQLOCK_READERS + i] = two())) {
+			u64 j;
+			for (j = 0; j < SEQLOCK_WRITES; j++) {
+				SeqGuard sg = seq_write_lock(&state->lock);
+				state->a++;
+				state->b = state->a * 3;
+				state->c = state->a * 7;
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < SEQLOCK_WRITERS; i++)
+		waitid(P_PID, pids[SEQLOCK_READERS + i], NULL, WEXITED);
+	ASTORE(&state->done, 1);
+	for (i = 0; i < SEQLOCK_READERS; i++)
+		waitid(P_PID, pids[i], NULL, WEXITED);
+	ASSERT_EQ(state->torn, 0, "consistent snapshots");
+	ASSERT_EQ(state->a, SEQLOCK_WRITERS * SEQLOCK_WRITES, "writes");
+	ASSERT_EQ(state->lock & 0x7FFFFFFF,
+		  2 * SEQLOCK_WRITERS * SEQLOCK_WRITES, "sequence");
+	munmap(state, sizeof(SeqState));
+}
+
+Test(lockprof) {
+	LockProfSite *site = lockprof_site("a.c", 10, LOCKPROF_WLOCK);
+	Formatter f = {0};
+	const u8 *s;
+
+	ASSERT(site, "site");
+	ASSERT_EQ(lockprof_site("a.c", 10, LOCKPROF_WLOCK), site, "same site");
+	ASSERT(lockprof_site("a.c", 10, LOCKPROF_RLOCK) != site, "by kind");
+	lockprof_wait(site, 100, true);
+	lockprof_wait(site, 50, false);
+	lockprof_hold(site, 7);
+	lockprof_hold(site, 9);
+	lockprof_wait(lockprof_site("b.c", 20, LOCKPROF_RECV), 30, true);
+#if LOCKPROF == 1
+	{
+		Lock l = LOCK_INIT;
+		LockGuard lg = wlock(&l);
+	}
+	{
+		FairLock l = FAIR_LOCK_INIT;
+		FairLockGuard lg = fair_rlock(&l);
+	}
+#endif /* LOCKPROF */
+	ASSERT(!lockprof_format(&f), "format");
+	s = format_to_string(&f);
+	ASSERT(substr(s, "a.c:10 wlock: acquisitions=2 contended=1 wait=150 "
+			 "max_wait=100 hold=16 max_hold=9\n"),
+	       "line");
+	ASSERT(substr(s, "b.c:20 recv: calls=1 empty=1 wait=30 max_wait=30\n"),
+	       "recv line");
+#if LOCKPROF == 1
+	ASSERT(substr(s, "test.c:"), "profiled wlock");
+	ASSERT(substr(s, " fair_rlock: acquisitions=1 contended=0"),
+	       "profiled fair_rlock");
+#endif /* LOCKPROF */
+	format_clear(&f);
+	lockprof_reset();
+	ASSERT_EQ(site->acquisitions, 0, "reset");
+}
+
+Test(spin_wait) {
+	WaitStats stats = {0}, *shared = smap(sizeof(WaitStats));
+	SpinWait sw = SPIN_WAIT_INIT(&stats);
+	Lock *lock = smap(sizeof(Lock));
+	u32 limit = spin_limit();
+	i32 pid;
+
+	ASSERT(shared && lock, "smap");
+	spin_set_limit(3);
+	ASSERT(spin_wait(&sw) && spin_wait(&sw) && spin_wait(&sw), "spin");
+	ASSERT(!spin_wait(&sw), "budget");
+	ASSERT_EQ(stats.spins, 3, "spins");
+	spin_set_limit(0);
+	sw.rounds = 0;
+	ASSERT(!spin_wait(&sw), "no spinning");
+	spin_set_limit(limit);
+
+	/* A contended writer spins, then sleeps until the holder leaves */
+	*lock = LOCK_INIT;
+	{
+		LockGuard lg = wlock(lock);
+		if (!(pid = two())) {
+			{
+				LockGuard lg2 = wlock_stats(lock, shared);
+			}
+			exit(0);
+		}
+		while (!(ALOAD(lock) & (0x1 << 29))) yield();
+	}
+	waitid(P_PID, pid, NULL, WEXITED);
+	ASSERT_EQ(shared->spins, limit, "spun");
+	ASSERT(shared->sleeps >= 1, "slept");
+	ASSERT_EQ(*lock, 0, "unlocked");
+	{
+		LockGuard lg = rlock_stats(lock, &stats);
+		ASSERT_EQ(*lock, 1, "reader");
+	}
+	ASSERT_EQ(stats.sleeps, 0, "uncontended");
+
+	munmap(shared, sizeof(WaitStats));
+	munmap(lock, sizeof(Lock));
+}
+
 typedef struct {
 	RobustLock lock1;
 	RobustLock lock2;
@@ -233,7 +493,7 @@ typedef struct {
 Test(robust1) {
 	RobustState *state = (RobustState *)smap(sizeof(RobustState));
 	i32 cpid, i;
-	state->lock1 = LOCK_INIT;
+	robust_init(&state->lock1);
 	state->value1 = 0;
 
 	/* reap any zombie processes */
@@ -263,7 +523,7 @@ Test(robust1) {
 Test(robust2) {
 	RobustState *state = (RobustState *)smap(sizeof(RobustState));
 	i32 cpid, i;
-	state->lock1 = LOCK_INIT;
+	robust_init(&state->lock1);
 	state->value1 = 0;
 	/* reap any zombie processes */
 	for (i = 0; i < 10; i++) waitid(P_PID, 0, NULL, WEXITED);
@@ -287,7 +547,7 @@ Test(robust2) {
 }
 
 Test(robust3) {
-	i32 lock = LOCK_INIT;
+	RobustLock lock = ROBUST_LOCK_INIT;
 	RobustGuardImpl rg = robust_lock(&lock);
 	err = SUCCESS;
 	robustguard_cleanup(&rg);
@@ -300,6 +560,38 @@ Test(robust3) {
 	_debug_no_exit = false;
 }
 
+Test(robust_owner_died) {
+	RobustState *state = (RobustState *)smap(sizeof(RobustState));
+	i32 cpid;
+
+	robust_init(&state->lock1);
+	state->value1 = 0;
+	if (!(cpid = two())) {
+		robust_lock(&state->lock1);
+		ASTORE(&state->value1, 1);
+		sleep(20);
+		exit(0);
+	}
+	while (!ALOAD(&state->value1)) yield();
+	/* The unreaped child still answers kill(), only the kernel's robust
+	 * list can hand the lock over */
+	err = SUCCESS;
+	{
+		RobustGuard rg = robust_lock(&state->lock1);
+		ASSERT_EQ(err, EOWNERDEAD, "owner died");
+		ASSERT_EQ(state->lock1.futex & FUTEX_TID_MASK, (u32)getpid(),
+			  "ours");
+	}
+	ASSERT_EQ(state->lock1.futex, 0, "unlocked");
+	err = SUCCESS;
+	{
+		RobustGuard rg = robust_lock(&state->lock1);
+		ASSERT_EQ(err, SUCCESS, "consistent again");
+	}
+	waitid(P_PID, cpid, NULL, WEXITED);
+	munmap(state, sizeof(RobustState));
+}
+
 typedef struct {
 	i32 x;
 	i32 y;
@@ -450,6 +742,468 @@ Test(channel_cycle) {
 	waitid(P_PID, pid, NULL, WEXITED);
 }
 
+#define MPMC_PRODUCERS 3
+#define MPMC_CONSUMERS 2
+#define MPMC_MESSAGES 2000
+
+Test(channel_mpmc) {
+	Channel ch = channel2(sizeof(TestMessage), 64);
+	u64 *results = smap(sizeof(u64) * 3 * MPMC_CONSUMERS);
+	i32 pids[MPMC_PRODUCERS + MPMC_CONSUMERS], i, j;
+	u64 count = 0, sum = 0, expected = 0;
+	TestMessage msg;
+
+	ASSERT(channel_ok(&ch) && results, "init");
+	for (i = 0; i < MPMC_CONSUMERS; i++) {
+		if (!(pids[i] = two())) {
+			u64 *res = results + i * 3;
+			while (true) {
+				recv(&ch, &msg);
+				if (msg.x < 0) break;
+				if (msg.y != -msg.x) res[2]++; /* torn */
+				res[0]++;
+				res[1] += msg.x;
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < MPMC_PRODUCERS; i++) {
+		if (!(pids[MPMC_CONSUMERS + i] = two())) {
+			for (j = 0; j < MPMC_MESSAGES; j++) {
+				msg.x = i * MPMC_MESSAGES + j;
+				msg.y = -msg.x;
+				while (send(&ch, &msg) < 0) yield();
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < MPMC_PRODUCERS; i++)
+		waitid(P_PID, pids[MPMC_CONSUMERS + i], NULL, WEXITED);
+	msg.x = msg.y = -1;
+	for (i = 0; i < MPMC_CONSUMERS; i++)
+		while (send(&ch, &msg) < 0) yield();
+	for (i = 0; i < MPMC_CONSUMERS; i++)
+		waitid(P_PID, pids[i], NULL, WEXITED);
+
+	for (i = 0; i < MPMC_CONSUMERS; i++) {
+		count += results[i * 3];
+		sum += results[i * 3 + 1];
+		ASSERT_EQ(results[i * 3 + 2], 0, "torn message");
+	}
+	for (i = 0; i < MPMC_PRODUCERS * MPMC_MESSAGES; i++) expected += i;
+	ASSERT_EQ(count, MPMC_PRODUCERS * MPMC_MESSAGES, "count");
+	ASSERT_EQ(sum, expected, "sum");
+	ASSERT_EQ(recv_now(&ch, &msg), -1, "empty");
+
+	munmap(results, sizeof(u64) * 3 * MPMC_CONSUMERS);
+	channel_destroy(&ch);
+	ASSERT_BYTES(0);
+}
+
+Test(channel_batch) {
+	Channel ch = channel2(sizeof(TestMessage), 8);
+	TestMessage in[10], out[10];
+	i64 start;
+	i32 i, pid, got;
+
+	for (i = 0; i < 10; i++) {
+		in[i].x = i;
+		in[i].y = -i;
+	}
+	ASSERT_EQ(send_batch(&ch, in, 5), 5, "send 5");
+	ASSERT_EQ(send_batch(&ch, in + 5, 5), 3, "partial");
+	ASSERT_EQ(send_batch(&ch, in, 1), -1, "full");
+	ASSERT_EQ(err, EOVERFLOW, "overflow");
+
+	ASSERT_EQ(recv_batch(&ch, out, 4, 0), 4, "recv 4");
+	ASSERT_EQ(recv_batch(&ch, out + 4, 10, 0), 4, "recv rest");
+	for (i = 0; i < 8; i++) ASSERT_EQ(out[i].x, i, "order");
+	ASSERT_EQ(recv_batch(&ch, out, 10, 0), -1, "empty");
+	ASSERT_EQ(err, EAGAIN, "eagain");
+	start = micros();
+	ASSERT_EQ(recv_batch(&ch, out, 10, 20), -1, "timeout");
+	ASSERT_EQ(err, ETIMEDOUT, "etimedout");
+	ASSERT(micros() - start >= 20000, "waited");
+
+	if ((pid = two())) {
+		got = 0;
+		while (got < 6) {
+			i64 n = recv_batch(&ch, out + got, 10 - got, -1);
+			ASSERT(n > 0, "blocking recv");
+			got += n;
+		}
+		for (i = 0; i < 6; i++) ASSERT_EQ(out[i].y, -i, "values");
+	} else {
+		sleep(10);
+		send_batch(&ch, in, 3);
+		send_batch(&ch, in + 3, 3);
+		exit(0);
+	}
+	waitid(P_PID, pid, NULL, WEXITED);
+	channel_destroy(&ch);
+	ASSERT_BYTES(0);
+}
+
+Test(channel_zero_copy) {
+	Channel ch = channel2(4096, 4);
+	u8 *a, *b, *p;
+	i32 i, pid;
+
+	a = channel_reserve(&ch);
+	b = channel_reserve(&ch);
+	ASSERT(a && b && a != b, "reserve");
+	memset(a, 'a', 4096);
+	memset(b, 'b', 4096);
+	ASSERT(!channel_commit(&ch, b), "commit b");
+	/* b waits behind the uncommitted a */
+	ASSERT(!channel_peek(&ch), "in order");
+	ASSERT_EQ(err, EAGAIN, "eagain");
+	ASSERT(!channel_commit(&ch, a), "commit a");
+
+	ASSERT_EQ(channel_peek(&ch), a, "peek a");
+	ASSERT_EQ(a[4095], 'a', "a data");
+	channel_release(&ch, a);
+	ASSERT_EQ(channel_peek(&ch), b, "peek b");
+	channel_release(&ch, b);
+	ASSERT(!channel_peek(&ch), "empty");
+
+	for (i = 0; i < 4; i++) ASSERT(channel_reserve(&ch), "fill");
+	ASSERT(!channel_reserve(&ch), "full");
+	ASSERT_EQ(err, EOVERFLOW, "overflow");
+	channel_destroy(&ch);
+
+	ch = channel2(4096, 4);
+	if ((pid = two())) {
+		for (i = 0; i < 16; i++) {
+			u8 msg[4096];
+			recv(&ch, msg);
+			ASSERT_EQ(msg[0], i, "first");
+			ASSERT_EQ(msg[4095], i, "last");
+		}
+	} else {
+		for (i = 0; i < 16; i++) {
+			while (!(p = channel_reserve(&ch))) yield();
+			memset(p, i, 4096);
+			channel_commit(&ch, p);
+		}
+		exit(0);
+	}
+	waitid(P_PID, pid, NULL, WEXITED);
+	channel_destroy(&ch);
+	ASSERT_BYTES(0);
+}
+
+Test(channel_unbounded) {
+	Channel ch = channel_unbounded(sizeof(TestMessage), 4);
+	u64 *results = smap(sizeof(u64) * 2 * MPMC_CONSUMERS);
+	TestMessage in[10], msg;
+	u64 count = 0, sum = 0, expected = 0;
+	i32 i, pids[MPMC_CONSUMERS];
+
+	ASSERT(channel_ok(&ch) && results, "init");
+	for (i = 0; i < 100; i++) {
+		msg.x = i;
+		msg.y = -i;
+		ASSERT(!send(&ch, &msg), "never full");
+	}
+	for (i = 0; i < 100; i++) {
+		ASSERT(!recv_now(&ch, &msg), "recv");
+		ASSERT_EQ(msg.x, i, "order");
+	}
+	ASSERT_EQ(recv_now(&ch, &msg), -1, "empty");
+	ASSERT_EQ(err, EAGAIN, "eagain");
+
+	for (i = 0; i < 10; i++) in[i].x = in[i].y = i;
+	ASSERT_EQ(send_batch(&ch, in, 10), 10, "whole batch");
+	/* A batch stops at the end of a segment */
+	for (i = 0; i < 10;) {
+		i64 n = recv_batch(&ch, in + i, 10 - i, 0);
+		ASSERT(n > 0 && n <= 4, "recv batch");
+		i += n;
+	}
+	for (i = 0; i < 10; i++) ASSERT_EQ(in[i].x, i, "batch order");
+	ASSERT_EQ(send_wait(&ch, &msg, 0), 0, "send_wait");
+	ASSERT(!recv_now(&ch, &msg), "recv send_wait");
+
+	for (i = 0; i < MPMC_CONSUMERS; i++) {
+		if (!(pids[i] = two())) {
+			u64 *res = results + i * 2;
+			while (true) {
+				recv(&ch, &msg);
+				if (msg.x < 0) break;
+				res[0]++;
+				res[1] += msg.x;
+			}
+			exit(0);
+		}
+	}
+	for (i = 0; i < MPMC_MESSAGES; i++) {
+		msg.x = i;
+		msg.y = -i;
+		ASSERT(!send(&ch, &msg), "send");
+	}
+	msg.x = msg.y = -1;
+	for (i = 0; i < MPMC_CONSUMERS; i++) send(&ch, &msg);
+	for (i = 0; i < MPMC_CONSUMERS; i++)
+		waitid(P_PID, pids[i], NULL, WEXITED);
+	for (i = 0; i < MPMC_CONSUMERS; i++) {
+		count += results[i * 2];
+		sum += results[i * 2 + 1];
+	}
+	for (i = 0; i < MPMC_MESSAGES; i++) expected += i;
+	ASSERT_EQ(count, MPMC_MESSAGES, "count");
+	ASSERT_EQ(sum, expected, "sum");
+
+	munmap(results, sizeof(u64) * 2 * MPMC_CONSUMERS);
+	channel_destroy(&ch);
+	ASSERT_BYTES(0);
+}
+
+ChannelInner *recv_segment(ChannelInner *inner);
+ChannelInner *send_segment(ChannelInner *inner);
+void *segment_peek(ChannelInner *inner, ChannelInner *seg);
+
+Test(channel_unbounded_recycled) {
+	Channel ch = channel_unbounded(sizeof(TestMessage), 2), big;
+	ChannelInner *parked;
+	TestMessage msg = {0};
+	i32 i;
+
+	ASSERT(channel_ok(&ch), "init");
+	for (i = 1; i <= 3; i++) {
+		msg.x = i;
+		ASSERT(!send(&ch, &msg), "send");
+	}
+	for (i = 1; i <= 3; i++) {
+		ASSERT(!recv_now(&ch, &msg), "recv");
+		ASSERT_EQ(msg.x, i, "order");
+	}
+	/* A receiver parks on the segment that held 3 */
+	parked = recv_segment(ch.inner);
+
+	/* It is drained and retired, then reused behind the one with 7, 8 */
+	for (i = 4; i <= 6; i++) {
+		msg.x = i;
+		ASSERT(!send(&ch, &msg), "send");
+	}
+	for (i = 4; i <= 6; i++) {
+		ASSERT(!recv_now(&ch, &msg), "recv");
+		ASSERT_EQ(msg.x, i, "order");
+	}
+	for (i = 7; i <= 9; i++) {
+		msg.x = i;
+		ASSERT(!send(&ch, &msg), "send");
+	}
+	ASSERT_EQ(send_segment(ch.inner), parked, "recycled");
+	ASSERT(recv_segment(ch.inner) != parked, "behind");
+
+	/* The parked receiver must not take 9 ahead of 7 and 8 */
+	ASSERT(!segment_peek(ch.inner, parked), "parked skips ahead");
+	for (i = 7; i <= 9; i++) {
+		ASSERT(!recv_now(&ch, &msg), "recv");
+		ASSERT_EQ(msg.x, i, "order");
+	}
+	ASSERT_EQ(recv_now(&ch, &msg), -1, "nothing lost or repeated");
+	channel_destroy(&ch);
+
+	/* Segments past the shared limit would be process-local */
+	big = channel_unbounded(1 << 20, 1024);
+	ASSERT(!channel_ok(&big), "too large");
+	ASSERT_EQ(err, EINVAL, "einval");
+	ASSERT_BYTES(0);
+}
+
+Test(channel_send_wait) {
+	Channel ch = channel2(sizeof(TestMessage), 2);
+	u64 *misordered = smap(sizeof(u64));
+	TestMessage msg = {0};
+	i64 start;
+	i32 i, pid;
+
+	ASSERT(!send_wait(&ch, &msg, 0), "room");
+	ASSERT(!send_wait(&ch, &msg, 0), "room2");
+	ASSERT_EQ(send_wait(&ch, &msg, 0), -1, "full");
+	ASSERT_EQ(err, EOVERFLOW, "overflow");
+	start = micros();
+	ASSERT_EQ(send_wait(&ch, &msg, 20), -1, "timeout");
+	ASSERT_EQ(err, ETIMEDOUT, "etimedout");
+	ASSERT(micros() - start >= 20000, "waited");
+
+	if ((pid = two())) {
+		/* Every send past the first two blocks until the child recvs */
+		for (i = 0; i < 20; i++) {
+			msg.x = i;
+			ASSERT(!send_wait(&ch, &msg, -1), "blocking send");
+		}
+	} else {
+		for (i = 0; i < 22; i++) {
+			if (i < 4) sleep(5);
+			recv(&ch, &msg);
+			if (i >= 2 && msg.x != i - 2) (*misordered)++;
+		}
+		exit(0);
+	}
+	waitid(P_PID, pid, NULL, WEXITED);
+	ASSERT_EQ(*misordered, 0, "order");
+	ASSERT_EQ(recv_now(&ch, &msg), -1, "drained");
+	munmap(misordered, sizeof(u64));
+	channel_destroy(&ch);
+	ASSERT_BYTES(0);
+}
+
+Test(broadcast_drop) {
+	Broadcast b = broadcast(sizeof(TestMessage), 4, 2, BROADCAST_DROP);
+	const TestMessage *p;
+	TestMessage msg;
+	i32 a, c, i;
+
+	ASSERT(broadcast_ok(&b), "init");
+	a = broadcast_subscribe(&b);
+	c = broadcast_subscribe(&b);
+	ASSERT(a >= 0 && c >= 0 && a != c, "subscribe");
+	ASSERT_EQ(broadcast_subscribe(&b), -1, "no room");
+	ASSERT_EQ(err, ENOSPC, "enospc");
+	ASSERT(!broadcast_peek(&b, a, 0), "empty");
+	ASSERT_EQ(err, EAGAIN, "eagain");
+
+	for (i = 0; i < 9; i++) {
+		msg.x = i;
+		msg.y = -i;
+		ASSERT(!broadcast_publish(&b, &msg, 0), "publish never blocks");
+	}
+	/* Both see the last ring's worth in place, having lost the rest */
+	for (i = 5; i < 9; i++) {
+		p = broadcast_peek(&b, a, 0);
+		ASSERT(p && p->x == i && p->y == -i, "peek a");
+		ASSERT(!broadcast_release(&b, a), "release a");
+		ASSERT(!broadcast_recv(&b, c, &msg, 0), "recv c");
+		ASSERT_EQ(msg.x, i, "recv c value");
+	}
+	ASSERT_EQ(broadcast_dropped(&b, a), 5, "dropped a");
+	ASSERT_EQ(broadcast_dropped(&b, c), 5, "dropped c");
+
+	msg.x = 9;
+	broadcast_publish(&b, &msg, 0);
+	p = broadcast_peek(&b, a, 0);
+	ASSERT(p && p->x == 9, "peek 9");
+	for (i = 10; i < 14; i++) {
+		msg.x = i;
+		broadcast_publish(&b, &msg, 0);
+	}
+	/* Message 9 was rewritten while held */
+	ASSERT_EQ(broadcast_release(&b, a), -1, "stale");
+	ASSERT_EQ(err, EOVERFLOW, "overflow");
+	ASSERT(!broadcast_recv(&b, a, &msg, 0) && msg.x == 10, "next");
+
+	broadcast_unsubscribe(&b, c);
+	ASSERT_EQ(broadcast_subscribe(&b), c, "reuse id");
+	ASSERT(!broadcast_peek(&b, c, 0), "starts at head");
+	broadcast_destroy(&b);
+	ASSERT_BYTES(0);
+}
+
+#define BROADCAST_SUBSCRIBERS 3
+#define BROADCAST_MESSAGES 500
+
+Test(broadcast_block) {
+	Broadcast b = broadcast(sizeof(TestMessage), 4, BROADCAST_SUBSCRIBERS,
+				BROADCAST_BLOCK);
+	u64 *misses = smap(sizeof(u64) * BROADCAST_SUBSCRIBERS);
+	i32 ids[BROADCAST_SUBSCRIBERS], pids[BROADCAST_SUBSCRIBERS], i, j;
+	TestMessage msg = {0};
+	i64 start;
+
+	ASSERT(broadcast_ok(&b) && misses, "init");
+	for (i = 0; i < BROADCAST_SUBSCRIBERS; i++)
+		ASSERT((ids[i] = broadcast_subscribe(&b)) >= 0, "subscribe");
+	for (i = 0; i < 4; i++) {
+		msg.x = i;
+		ASSERT(!broadcast_publish(&b, &msg, 0), "room");
+	}
+	ASSERT_EQ(broadcast_publish(&b, &msg, 0), -1, "full");
+	ASSERT_EQ(err, EOVERFLOW, "overflow");
+	start = micros();
+	ASSERT_EQ(broadcast_publish(&b, &msg, 20), -1, "timeout");
+	ASSERT_EQ(err, ETIMEDOUT, "etimedout");
+	ASSERT(micros() - start >= 20000, "waited");
+
+	for (i = 0; i < BROADCAST_SUBSCRIBERS; i++) {
+		if (!(pids[i] = two())) {
+			for (j = 0; j < BROADCAST_MESSAGES; j++) {
+				if (broadcast_recv(&b, ids[i], &msg, -1) ||
+				    msg.x != j)
+					misses[i]++;
+			}
+			exit(0);
+		}
+	}
+	for (i = 4; i < BROADCAST_MESSAGES; i++) {
+		msg.x = i;
+		ASSERT(!broadcast_publish(&b, &msg, -1), "blocking publish");
+	}
+	for (i = 0; i < BROADCAST_SUBSCRIBERS; i++) {
+		waitid(P_PID, pids[i], NULL, WEXITED);
+		ASSERT_EQ(misses[i], 0, "every subscriber sees every message");
+		ASSERT_EQ(broadcast_dropped(&b, ids[i]), 0, "none dropped");
+	}
+	munmap(misses, sizeof(u64) * BROADCAST_SUBSCRIBERS);
+	broadcast_destroy(&b);
+	ASSERT_BYTES(0);
+}
+
+Test(channel_select) {
+	Channel chs[3];
+	TestMessage msg = {0};
+	Event events[4];
+	i32 i, pid, mplex, fd;
+	i64 start;
+
+	for (i = 0; i < 3; i++) chs[i] = channel(sizeof(TestMessage));
+	ASSERT_EQ(channel_select(chs, 0, 0), -1, "none");
+	ASSERT_EQ(err, EINVAL, "einval");
+	ASSERT_EQ(channel_select(chs, 3, 0), -1, "poll");
+	ASSERT_EQ(err, EAGAIN, "eagain");
+	start = micros();
+	ASSERT_EQ(channel_select(chs, 3, 20), -1, "select timeout");
+	ASSERT_EQ(err, ETIMEDOUT, "etimedout");
+	ASSERT(micros() - start >= 20000, "waited");
+	ASSERT_EQ(recv_timeout(&chs[0], &msg, 10), -1, "recv timeout");
+	ASSERT_EQ(err, ETIMEDOUT, "etimedout2");
+
+	/* The eventfd is shared with the sender created after it */
+	fd = channel_eventfd(&chs[1]);
+	ASSERT(fd >= 0, "eventfd");
+	ASSERT_EQ(channel_eventfd(&chs[1]), fd, "same fd");
+	mplex = multiplex();
+	ASSERT(!mregister(mplex, fd, MULTIPLEX_FLAG_READ, &chs[1]), "mregister");
+
+	if ((pid = two())) {
+		ASSERT_EQ(channel_select(chs, 3, -1), 2, "selected");
+		ASSERT(!recv_timeout(&chs[2], &msg, 0), "recv selected");
+		ASSERT_EQ(msg.x, 2, "x=2");
+		ASSERT(!send(&chs[0], &msg), "ack");
+		waitid(P_PID, pid, NULL, WEXITED);
+		ASSERT_EQ(mwait(mplex, events, 4, 1000), 1, "event");
+		ASSERT_EQ(event_attachment(events[0]), &chs[1], "attach");
+		channel_event_ack(&chs[1]);
+		for (i = 0; recv_now(&chs[1], &msg) == 0; i++);
+		ASSERT_EQ(i, 2, "drained");
+	} else {
+		sleep(10);
+		msg.x = 2;
+		send(&chs[2], &msg);
+		recv(&chs[0], &msg);
+		msg.x = 1;
+		send(&chs[1], &msg);
+		send(&chs[1], &msg);
+		exit(0);
+	}
+	ASSERT_EQ(mwait(mplex, events, 4, 0), 0, "no event");
+	close(mplex);
+	for (i = 0; i < 3; i++) channel_destroy(&chs[i]);
+	ASSERT_BYTES(0);
+}
+
 Test(channel_err) {
 	TestMessage msg;
 	i32 i;
@@ -714,6 +1468,112 @@ Test(rbtree3) {
 	validate_rbtree(&tree);
 }
 
+Test(pool1) {
+	Pool *p;
+	void *objs[40], *o1, *o2;
+	u64 *shared = smap(sizeof(u64));
+	i32 i, j, pid;
+
+	err = 0;
+	ASSERT(!pool_create(0, 8), "zero size");
+	ASSERT(!pool_create(8, 12), "align not power of two");
+	ASSERT_EQ(err, EINVAL, "einval");
+
+	p = pool_create(8000, 64);
+	ASSERT(p, "pool_create");
+	o1 = pool_get(p);
+	ASSERT(o1, "get");
+	ASSERT_EQ((u64)o1 % 64, 0, "aligned");
+	ASSERT_EQ(pool_of(o1), p, "pool_of");
+	pool_put(p, o1);
+	ASSERT_EQ(pool_get(p), o1, "lifo reuse");
+
+	/* Spans several blocks */
+	ASSERT_EQ(pool_get_bulk(p, objs, 40), 40, "bulk get");
+	for (i = 0; i < 40; i++) {
+		ASSERT_EQ((u64)objs[i] % 64, 0, "aligned");
+		memset(objs[i], i, 8000);
+		for (j = 0; j < i; j++) ASSERT(objs[i] != objs[j], "distinct");
+	}
+	pool_put_bulk(p, objs, 40);
+	ASSERT_EQ(pool_get_bulk(p, objs, 40), 40, "bulk reuse");
+	pool_put_bulk(p, objs, 40);
+
+	/* Another process takes and returns objects */
+	if ((pid = two())) {
+		waitid(P_PID, pid, NULL, WEXITED);
+	} else {
+		o2 = pool_get(p);
+		*shared = (u64)o2;
+		pool_put(p, o2);
+		exit(0);
+	}
+	ASSERT(*shared, "child get");
+	ASSERT_EQ(pool_get(p), (void *)*shared, "child put");
+	pool_put(p, (void *)*shared);
+
+	/* Freed when the last object comes back */
+	pool_destroy(p);
+	pool_put(p, o1);
+	munmap(shared, sizeof(u64));
+	ASSERT_BYTES(0);
+}
+
+Test(arena1) {
+	Arena a = ARENA_INIT;
+	ArenaMark m;
+	u8 *p, *q, *r, *big;
+	u64 i;
+
+	ASSERT_EQ(arena_init(&a, 0), -1, "block size");
+	ASSERT_EQ(arena_init(&a, 4096), 0, "init");
+	ASSERT(!arena_alloc(&a, 0), "zero");
+	ASSERT_EQ(err, EINVAL, "einval");
+
+	p = arena_alloc(&a, 3);
+	q = arena_alloc(&a, 17);
+	ASSERT(p && q, "alloc");
+	ASSERT(!((u64)p & 15) && !((u64)q & 15), "aligned");
+	ASSERT_EQ(q, p + 16, "bump");
+
+	/* The last allocation grows in place */
+	r = arena_resize(&a, q, 17, 100);
+	ASSERT_EQ(r, q, "in place");
+	r = arena_resize(&a, p, 3, 64);
+	ASSERT(r && r != p, "moved");
+
+	m = arena_mark(&a);
+	for (i = 0; i < 100; i++) ASSERT(arena_alloc(&a, 1000), "fill");
+	big = arena_alloc(&a, 100000);
+	ASSERT(big, "big");
+	memset(big, 1, 100000);
+	arena_reset(&m);
+	ASSERT_EQ(arena_alloc(&a, 16), m.pos, "reset");
+
+	/* Blocks are reused after a reset */
+	{
+		ArenaGuard g = arena_mark(&a);
+		p = arena_alloc(&a, 1000);
+		ASSERT(p, "guard alloc");
+	}
+	{
+		ArenaGuard g = arena_mark(&a);
+		ASSERT_EQ(arena_alloc(&a, 1000), p, "guard reset");
+	}
+
+	{
+		Formatter f = FORMATTER_ARENA(&a);
+		ArenaGuard g = arena_mark(&a);
+		format(&f, "abc{}", 123);
+		format(&f, "{}", "def");
+		ASSERT(!strcmp(format_to_string(&f), "abc123def"), "string");
+		format_clear(&f);
+	}
+
+	arena_destroy(&a);
+	ASSERT_BYTES(0);
+}
+
 Test(vec1) {
 	u8 buf[100] = {0};
 	Vec *v = vec_new(100);
@@ -739,6 +1599,137 @@ Test(vec1) {
 	ASSERT_BYTES(0);
 }
 
+Test(vec_growth) {
+	u8 buf[1000];
+	u64 i, resizes = 0, last = 0;
+	Vec *v = NULL, *tmp;
+
+	v = vec_push(v, 'a');
+	ASSERT(v, "push to NULL");
+	ASSERT_EQ(vec_size(v), 1, "size=1");
+	ASSERT_EQ(vec_capacity(v), VEC_MIN_CAPACITY, "min capacity");
+
+	for (i = 0; i < sizeof(buf); i++) buf[i] = (u8)i;
+	for (i = 0; i < 1000; i++) {
+		v = vec_append_grow(v, buf, sizeof(buf));
+		ASSERT(v, "append_grow");
+		if (vec_capacity(v) != last) {
+			last = vec_capacity(v);
+			resizes++;
+		}
+	}
+	ASSERT_EQ(vec_size(v), 1 + 1000 * sizeof(buf), "size");
+	ASSERT(resizes <= 16, "geometric growth");
+	ASSERT_EQ(((u8 *)vec_data(v))[0], 'a', "first byte");
+	ASSERT(!memcmp((u8 *)vec_data(v) + 1 + 999 * sizeof(buf), buf,
+		       sizeof(buf)),
+	       "last append");
+
+	ASSERT(!vec_truncate(v, 10), "truncate");
+	v = vec_shrink_to_fit(v);
+	ASSERT(v, "shrink");
+	ASSERT_EQ(vec_capacity(v), 10, "capacity=10");
+	ASSERT_EQ(((u8 *)vec_data(v))[1], 0, "data kept");
+
+	tmp = vec_reserve(v, 100);
+	ASSERT(tmp, "reserve");
+	v = tmp;
+	ASSERT(vec_capacity(v) >= 110, "reserved");
+	ASSERT_EQ(vec_size(v), 10, "reserve keeps size");
+	last = vec_capacity(v);
+	ASSERT_EQ(vec_reserve(v, 100), v, "reserve no-op");
+	ASSERT_EQ(vec_capacity(v), last, "capacity unchanged");
+
+	ASSERT(!vec_reserve(v, U64_MAX), "reserve overflow");
+	ASSERT_EQ(err, EOVERFLOW, "EOVERFLOW");
+	ASSERT_EQ(vec_size(v), 10, "size kept after overflow");
+
+	vec_release(v);
+	ASSERT_BYTES(0);
+}
+
+Test(bytering) {
+	u8 buf[128], out[128];
+	u64 i, len;
+	u8 *span;
+	ByteRing *r = bytering_new(100, 0), *tmp;
+
+	ASSERT(r, "r!=NULL");
+	ASSERT_EQ(bytering_capacity(r), 128, "capacity=128");
+	ASSERT_EQ(bytering_size(r), 0, "size=0");
+	ASSERT(!bytering_new(10, 0x80), "bad flags");
+	ASSERT_EQ(err, EINVAL, "EINVAL");
+	for (i = 0; i < sizeof(buf); i++) buf[i] = (u8)i;
+
+	/* Fill, drain part, then wrap the tail around */
+	ASSERT(!bytering_write(r, buf, 100), "write 100");
+	ASSERT(!bytering_consume(r, 90), "consume 90");
+	ASSERT(!bytering_write(r, buf, 50), "write 50 wraps");
+	ASSERT_EQ(bytering_size(r), 60, "size=60");
+	ASSERT_EQ(bytering_space(r), 68, "space=68");
+	span = bytering_readable(r, &len);
+	ASSERT_EQ(len, 38, "readable stops at the end");
+	ASSERT(!memcmp(span, buf + 90, 10), "old bytes");
+	span = bytering_writable(r, &len);
+	ASSERT_EQ(len, 68, "writable is the gap");
+	ASSERT(bytering_write(r, buf, 69), "overflow");
+	ASSERT_EQ(err, ENOBUFS, "ENOBUFS");
+	ASSERT(bytering_consume(r, 61), "consume too much");
+	ASSERT(bytering_commit(r, 69), "commit too much");
+
+	/* Wrapped part fits in the gap */
+	span = bytering_linearize(r);
+	ASSERT_EQ(bytering_size(r), 60, "size kept");
+	ASSERT(!memcmp(span, buf + 90, 10), "linear head");
+	ASSERT(!memcmp(span + 10, buf, 50), "linear tail");
+	span = bytering_readable(r, &len);
+	ASSERT_EQ(len, 60, "readable contiguous");
+
+	/* Wrapped part larger than the gap rotates the storage */
+	ASSERT(!bytering_consume(r, 60), "drain");
+	ASSERT(!bytering_write(r, buf, 120), "write 120");
+	ASSERT(!bytering_consume(r, 100), "consume 100");
+	ASSERT(!bytering_write(r, buf, 100), "write 100 wraps");
+	span = bytering_linearize(r);
+	ASSERT(!memcmp(span, buf + 100, 20), "rotated head");
+	ASSERT(!memcmp(span + 20, buf, 100), "rotated tail");
+
+	/* Growing keeps the queued bytes in order */
+	ASSERT(!bytering_consume(r, 5), "consume 5");
+	tmp = bytering_reserve(r, 200);
+	ASSERT(tmp, "reserve");
+	r = tmp;
+	ASSERT_EQ(bytering_capacity(r), 512, "capacity=512");
+	ASSERT_EQ(bytering_size(r), 115, "size=115");
+	span = bytering_readable(r, &len);
+	ASSERT_EQ(len, 115, "readable after reserve");
+	ASSERT(!memcmp(span, buf + 105, 15), "reserve head");
+	ASSERT(!memcmp(span + 15, buf, 100), "reserve tail");
+	ASSERT_EQ(bytering_reserve(r, 10), r, "reserve no-op");
+	bytering_release(r);
+
+	/* Mirrored rings expose every readable byte in one span */
+	r = bytering_new(1, BYTERING_MIRROR);
+	ASSERT(r, "mirror");
+	ASSERT_EQ(bytering_capacity(r), PAGE_SIZE, "page sized");
+	for (i = 0; i < PAGE_SIZE / sizeof(buf); i++)
+		ASSERT(!bytering_write(r, buf, sizeof(buf)), "fill mirror");
+	ASSERT(!bytering_consume(r, PAGE_SIZE - sizeof(buf)), "consume mirror");
+	ASSERT(!bytering_write(r, buf, sizeof(buf)), "wrap mirror");
+	span = bytering_readable(r, &len);
+	ASSERT_EQ(len, 2 * sizeof(buf), "mirror span");
+	ASSERT(!memcmp(span, buf, sizeof(buf)), "mirror head");
+	ASSERT(!memcmp(span + sizeof(buf), buf, sizeof(buf)), "mirror tail");
+	ASSERT_EQ(bytering_linearize(r), span, "mirror linearize is free");
+	span = bytering_writable(r, &len);
+	ASSERT_EQ(len, PAGE_SIZE - 2 * sizeof(buf), "mirror writable");
+	memcpy(out, span - sizeof(buf), sizeof(buf));
+	ASSERT(!memcmp(out, buf, sizeof(buf)), "aliased storage");
+	bytering_release(r);
+
+	ASSERT_BYTES(0);
+}
+
 #define LZX_HASH_ENTRIES 4096
 #define HASH_CONSTANT 2654435761U
 #define MIN_MATCH 6
@@ -25,6 +25,7 @@
 
 #include <libfam/alloc.H>
 #include <libfam/error.H>
+#include <libfam/limits.H>
 #include <libfam/misc.H>
 #include <libfam/vec.H>
 
@@ -55,8 +56,21 @@ i32 vec_extend(Vec *v, void *data, u64 len) {
 	return 0;
 }
 
+STATIC u64 vec_grow_capacity(u64 capacity, u64 needed) {
+	u64 next;
+	if (capacity < VEC_MIN_CAPACITY)
+		next = VEC_MIN_CAPACITY;
+	else if (capacity < VEC_GROW_CAP)
+		next = capacity << 1;
+	else if (capacity <= U64_MAX - VEC_GROW_CAP)
+		next = capacity + VEC_GROW_CAP;
+	else
+		next = needed;
+	return next < needed ? needed : next;
+}
+
 Vec *vec_resize(Vec *v, u64 nsize) {
-	Vec *ret = resize(v, nsize + sizeof(Vec));
+	Vec *ret = resize_hint(v, nsize + sizeof(Vec), RESIZE_GROW_POW2);
 	if (!ret) return NULL;
 	ret->capacity = nsize;
 	if (!v)
@@ -93,3 +107,36 @@ i32 vec_truncate(Vec *v, u64 nsize) {
 	return 0;
 }
 
+Vec *vec_reserve(Vec *v, u64 additional) {
+	u64 bytes = vec_size(v), capacity = vec_capacity(v);
+	if (bytes + additional < bytes ||
+	    bytes + additional > U64_MAX - sizeof(Vec)) {
+		err = EOVERFLOW;
+		return NULL;
+	}
+	if (v && capacity - bytes >= additional) return v;
+	return vec_resize(v, vec_grow_capacity(capacity, bytes + additional));
+}
+
+Vec *vec_shrink_to_fit(Vec *v) {
+	Vec *ret;
+	if (!v) {
+		err = EINVAL;
+		return NULL;
+	}
+	if (v->capacity == v->bytes) return v;
+	ret = resize_hint(v, v->bytes + sizeof(Vec), RESIZE_EXACT);
+	if (!ret) return NULL;
+	ret->capacity = ret->bytes;
+	return ret;
+}
+
+Vec *vec_push(Vec *v, u8 value) { return vec_append_grow(v, &value, 1); }
+
+Vec *vec_append_grow(Vec *v, const void *data, u64 len) {
+	Vec *ret = vec_reserve(v, len);
+	if (!ret) return NULL;
+	memcpy((u8 *)ret + sizeof(Vec) + ret->bytes, data, len);
+	ret->bytes += len;
+	return ret;
+}